@@ -152,7 +152,13 @@ fat_boot_create (void) {
 
 void
 fat_fs_init (void) {
-	/* TODO: Your code goes here. */
+	/* The data area follows the FAT, and cluster 1 is its first
+	 * cluster; FAT entry 0 is not used, as 0 marks a free cluster. */
+	fat_fs->data_start = fat_fs->bs.fat_start + fat_fs->bs.fat_sectors;
+	fat_fs->fat_length = (fat_fs->bs.total_sectors - fat_fs->data_start)
+		/ SECTORS_PER_CLUSTER + 1;
+	fat_fs->last_clst = ROOT_DIR_CLUSTER;
+	lock_init (&fat_fs->write_lock);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -164,30 +170,182 @@ fat_fs_init (void) {
  * Returns 0 if fails to allocate a new cluster. */
 cluster_t
 fat_create_chain (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	cluster_t new = 0;
+
+	lock_acquire (&fat_fs->write_lock);
+	/* Next fit: look on from the cluster taken last, so that a
+	 * growing file tends to get consecutive clusters. */
+	for (unsigned int n = 1; n < fat_fs->fat_length; n++) {
+		cluster_t c = (fat_fs->last_clst + n - 1) % (fat_fs->fat_length - 1) + 1;
+
+		if (fat_fs->fat[c] == 0) {
+			new = c;
+			break;
+		}
+	}
+	if (new != 0) {
+		fat_fs->fat[new] = EOChain;
+		if (clst != 0)
+			fat_put (clst, new);
+		fat_fs->last_clst = new;
+	}
+	lock_release (&fat_fs->write_lock);
+	return new;
 }
 
 /* Remove the chain of clusters starting from CLST.
  * If PCLST is 0, assume CLST as the start of the chain. */
 void
 fat_remove_chain (cluster_t clst, cluster_t pclst) {
-	/* TODO: Your code goes here. */
+	lock_acquire (&fat_fs->write_lock);
+	if (pclst != 0)
+		fat_put (pclst, EOChain);
+	while (clst != EOChain) {
+		cluster_t next = fat_get (clst);
+
+		fat_put (clst, 0);
+		clst = next;
+	}
+	lock_release (&fat_fs->write_lock);
 }
 
 /* Update a value in the FAT table. */
 void
 fat_put (cluster_t clst, cluster_t val) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+	fat_fs->fat[clst] = val;
 }
 
 /* Fetch a value in the FAT table. */
 cluster_t
 fat_get (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+	return fat_fs->fat[clst];
 }
 
 /* Covert a cluster # to a sector number. */
 disk_sector_t
 cluster_to_sector (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+	return fat_fs->data_start + (clst - 1) * SECTORS_PER_CLUSTER;
+}
+
+/* Convert a sector number in the data area to its cluster #. */
+cluster_t
+sector_to_cluster (disk_sector_t sector) {
+	ASSERT (sector >= fat_fs->data_start);
+	return (sector - fat_fs->data_start) / SECTORS_PER_CLUSTER + 1;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Cluster chain cache                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* Sets up CHAIN for the chain that starts at cluster START, or for
+ * an empty chain if START is 0. */
+void
+fat_chain_init (struct fat_chain *chain, cluster_t start) {
+	chain->start = start;
+	chain->last_idx = 0;
+	chain->last_clst = start;
+	chain->ckpts = NULL;
+	chain->ckpt_cnt = chain->ckpt_cap = 0;
+}
+
+/* Frees the checkpoints of CHAIN. */
+void
+fat_chain_destroy (struct fat_chain *chain) {
+	free (chain->ckpts);
+	fat_chain_init (chain, 0);
+}
+
+/* Records that cluster IDX of CHAIN is CLST, as checkpoint POS.  A
+ * checkpoint that cannot be recorded for lack of memory is just
+ * not kept. */
+static void
+add_checkpoint (struct fat_chain *chain, size_t pos, size_t idx,
+		cluster_t clst) {
+	if (chain->ckpt_cnt == chain->ckpt_cap) {
+		size_t cap = chain->ckpt_cap > 0 ? chain->ckpt_cap * 2 : 8;
+		struct fat_checkpoint *ckpts = realloc (chain->ckpts,
+				cap * sizeof *ckpts);
+
+		if (ckpts == NULL)
+			return;
+		chain->ckpts = ckpts;
+		chain->ckpt_cap = cap;
+	}
+	memmove (chain->ckpts + pos + 1, chain->ckpts + pos,
+			(chain->ckpt_cnt - pos) * sizeof *chain->ckpts);
+	chain->ckpts[pos].idx = idx;
+	chain->ckpts[pos].clst = clst;
+	chain->ckpt_cnt++;
+}
+
+/* Returns cluster IDX of CHAIN, counting from 0, or 0 if the chain
+ * is not that long.
+ *
+ * The walk starts from the closest position known at or before
+ * IDX: the cluster looked up last, so that sequential lookups take
+ * one step each, or the checkpoint found by binary search, so that
+ * random ones take at most FAT_CHAIN_STRIDE steps.  Every
+ * FAT_CHAIN_STRIDE'th cluster the walk passes becomes a
+ * checkpoint. */
+cluster_t
+fat_chain_lookup (struct fat_chain *chain, size_t idx) {
+	size_t lo = 0, hi = chain->ckpt_cnt, pos;
+	size_t walk_idx = 0;
+	cluster_t clst = chain->start;
+
+	if (clst == 0)
+		return 0;
+
+	/* Find the last checkpoint at or before IDX.  New checkpoints
+	 * go right after it, since none lies between it and IDX. */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (chain->ckpts[mid].idx <= idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	pos = lo;
+	if (pos > 0) {
+		walk_idx = chain->ckpts[pos - 1].idx;
+		clst = chain->ckpts[pos - 1].clst;
+	}
+	if (chain->last_clst != 0 && chain->last_idx <= idx
+			&& chain->last_idx > walk_idx) {
+		walk_idx = chain->last_idx;
+		clst = chain->last_clst;
+	}
+
+	while (walk_idx < idx) {
+		clst = fat_get (clst);
+		if (clst == EOChain || clst == 0)
+			return 0;
+		walk_idx++;
+		if (walk_idx % FAT_CHAIN_STRIDE == 0)
+			add_checkpoint (chain, pos++, walk_idx, clst);
+	}
+	chain->last_idx = idx;
+	chain->last_clst = clst;
+	return clst;
+}
+
+/* Forgets what CHAIN knows about its clusters from index LEN on,
+ * after they were removed from it. */
+void
+fat_chain_truncate (struct fat_chain *chain, size_t len) {
+	if (len == 0) {
+		fat_chain_destroy (chain);
+		return;
+	}
+	while (chain->ckpt_cnt > 0 && chain->ckpts[chain->ckpt_cnt - 1].idx >= len)
+		chain->ckpt_cnt--;
+	if (chain->last_idx >= len) {
+		chain->last_idx = 0;
+		chain->last_clst = chain->start;
+	}
 }
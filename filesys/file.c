@@ -1,6 +1,8 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include <round.h>
 #include "filesys/inode.h"
+#include "filesys/page_cache.h"
 #include "threads/malloc.h"
 
 /* An open file. */
@@ -8,8 +10,17 @@ struct file {
 	struct inode *inode;        /* File's inode. */
 	off_t pos;                  /* Current position. */
 	bool deny_write;            /* Has file_deny_write() been called? */
+	off_t ra_next;              /* Where a sequential read would start. */
+	size_t ra_pages;            /* Readahead window in pages, or 0. */
+	size_t ra_end;              /* First page not read ahead yet. */
 };
 
+/* Bounds of the readahead window, in pages.  It is also kept to a
+ * quarter of the page cache, so that reading ahead never pushes
+ * everything else out of it. */
+#define RA_MIN_PAGES 4
+#define RA_MAX_PAGES (128 * 1024 / PGSIZE)
+
 /* Opens a file for the given INODE, of which it takes ownership,
  * and returns the new file.  Returns a null pointer if an
  * allocation fails or if INODE is null. */
@@ -64,14 +75,52 @@ file_get_inode (struct file *file) {
 	return file->inode;
 }
 
+/* Reads ahead of FILE, which was just read from POS to END.  A
+ * read that starts where the last one ended is sequential.  Then,
+ * once the reader is within half a window of the end of what was
+ * read ahead, the next window is read ahead, and the window
+ * doubles, from RA_MIN_PAGES up to RA_MAX_PAGES.  Any other read
+ * halves the window and reads nothing ahead, so that random access
+ * costs no extra I/O. */
+static void
+read_ahead (struct file *file, off_t pos, off_t end) {
+	size_t max = page_cache_pages / 4 < RA_MAX_PAGES
+		? page_cache_pages / 4 : RA_MAX_PAGES;
+	size_t end_page = DIV_ROUND_UP (end, PGSIZE);
+	bool sequential = pos == file->ra_next;
+
+	file->ra_next = end;
+	if (!sequential) {
+		file->ra_pages /= 2;
+		file->ra_end = 0;
+		return;
+	}
+	if (file->ra_pages == 0)
+		file->ra_pages = RA_MIN_PAGES;
+	if (file->ra_pages > max)
+		file->ra_pages = max;
+	if (file->ra_pages == 0 || pos == end)
+		return;
+
+	if (file->ra_end < end_page)
+		file->ra_end = end_page;
+	if (file->ra_end - end_page <= file->ra_pages / 2) {
+		inode_readahead (file->inode, file->ra_end, file->ra_pages);
+		file->ra_end += file->ra_pages;
+		file->ra_pages = file->ra_pages * 2 < max ? file->ra_pages * 2 : max;
+	}
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
  * starting at the file's current position.
  * Returns the number of bytes actually read,
  * which may be less than SIZE if end of file is reached.
- * Advances FILE's position by the number of bytes read. */
+ * Advances FILE's position by the number of bytes read, and
+ * reads ahead if the file is being read sequentially. */
 off_t
 file_read (struct file *file, void *buffer, off_t size) {
 	off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+	read_ahead (file, file->pos, file->pos + bytes_read);
 	file->pos += bytes_read;
 	return bytes_read;
 }
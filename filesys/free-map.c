@@ -36,6 +36,22 @@ free_map_allocate (size_t cnt, disk_sector_t *sectorp) {
 	return sector != BITMAP_ERROR;
 }
 
+/* Allocates the CNT sectors starting at SECTOR, if all of them
+ * are free, so that a file can grow in place.
+ * Returns true if successful, false otherwise. */
+bool
+free_map_allocate_at (disk_sector_t sector, size_t cnt) {
+	if (sector + cnt > bitmap_size (free_map)
+			|| bitmap_contains (free_map, sector, cnt, true))
+		return false;
+	bitmap_set_multiple (free_map, sector, cnt, true);
+	if (free_map_file != NULL && !bitmap_write (free_map, free_map_file)) {
+		bitmap_set_multiple (free_map, sector, cnt, false);
+		return false;
+	}
+	return true;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (disk_sector_t sector, size_t cnt) {
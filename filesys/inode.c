@@ -4,20 +4,63 @@
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
 #include "filesys/free-map.h"
+#include "filesys/page_cache.h"
 #include "threads/malloc.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+#ifdef EFILESYS
 /* On-disk inode.
  * Must be exactly DISK_SECTOR_SIZE bytes long. */
 struct inode_disk {
-	disk_sector_t start;                /* First data sector. */
 	off_t length;                       /* File size in bytes. */
 	unsigned magic;                     /* Magic number. */
+	cluster_t start;                    /* First data cluster, or 0. */
 	uint32_t unused[125];               /* Not used. */
 };
+#else
+/* A run of consecutive data sectors of a file. */
+struct extent {
+	uint32_t first;                     /* Index of its first sector in
+	                                       the file. */
+	disk_sector_t start;                /* First sector on disk. */
+	uint32_t cnt;                       /* Number of sectors. */
+};
+
+/* Extents held in the inode itself, and in its indirect block. */
+#define INLINE_EXTENTS 41
+#define INDIRECT_EXTENTS 42
+#define MAX_EXTENTS (INLINE_EXTENTS + INDIRECT_EXTENTS)
+
+/* On-disk inode.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct inode_disk {
+	off_t length;                       /* File size in bytes. */
+	unsigned magic;                     /* Magic number. */
+	uint32_t extent_cnt;                /* Extents in use. */
+	disk_sector_t indirect;             /* Block of the extents past
+	                                       INLINE_EXTENTS, if any. */
+	struct extent extents[INLINE_EXTENTS];  /* First extents, in file
+	                                           order. */
+	uint32_t unused[1];                 /* Not used. */
+};
+
+/* Indirect extent block.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct extent_block {
+	struct extent extents[INDIRECT_EXTENTS];  /* Extents after the
+	                                             inline ones. */
+	uint32_t unused[2];                 /* Not used. */
+};
+#endif
 
 /* Returns the number of sectors to allocate for an inode SIZE
  * bytes long. */
@@ -34,19 +77,325 @@ struct inode {
 	bool removed;                       /* True if deleted, false otherwise. */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
 	struct inode_disk data;             /* Inode content. */
+#ifdef EFILESYS
+	struct fat_chain chain;             /* Where its clusters are. */
+#else
+	struct extent_block *indirect;      /* Its indirect block, if any. */
+#endif
 };
 
+/* Writes zeros to the CNT sectors starting at SECTOR. */
+static void
+zero_sectors (disk_sector_t sector, size_t cnt) {
+	static uint8_t zeros[PGSIZE];
+	const size_t run = sizeof zeros / DISK_SECTOR_SIZE;
+
+	for (; cnt > 0; ) {
+		size_t n = cnt < run ? cnt : run;
+
+		disk_write_sectors (filesys_disk, sector, zeros, n);
+		sector += n;
+		cnt -= n;
+	}
+}
+
+#ifdef EFILESYS
+/* Returns the disk sector that contains byte offset POS within
+ * INODE.
+ * Returns -1 if INODE does not contain data for a byte at offset
+ * POS. */
+static disk_sector_t
+byte_to_sector (struct inode *inode, off_t pos) {
+	size_t sector;
+
+	ASSERT (inode != NULL);
+	if (pos >= inode->data.length)
+		return -1;
+
+	sector = pos / DISK_SECTOR_SIZE;
+	return cluster_to_sector (fat_chain_lookup (&inode->chain,
+				sector / SECTORS_PER_CLUSTER))
+		+ sector % SECTORS_PER_CLUSTER;
+}
+
+/* Returns the number of clusters of data for SIZE bytes. */
+static size_t
+bytes_to_clusters (off_t size) {
+	return DIV_ROUND_UP (bytes_to_sectors (size), SECTORS_PER_CLUSTER);
+}
+
+/* Writes INODE's on-disk inode. */
+static void
+write_inode (const struct inode *inode) {
+	disk_write (filesys_disk, inode->sector, &inode->data);
+}
+
+/* Makes INODE LENGTH bytes long, if it is shorter, and writes it
+ * to disk.  New clusters go at the end of its chain, and read as
+ * zeros.  Returns false if the disk runs out, leaving INODE as it
+ * was. */
+static bool
+inode_grow (struct inode *inode, off_t length) {
+	size_t have = bytes_to_clusters (inode->data.length);
+	size_t need = bytes_to_clusters (length);
+	cluster_t old_last, last, first_new = 0;
+
+	if (length <= inode->data.length)
+		return true;
+
+	old_last = last = have > 0 ? fat_chain_lookup (&inode->chain, have - 1) : 0;
+	for (size_t i = have; i < need; i++) {
+		cluster_t clst = fat_create_chain (last);
+
+		if (clst == 0) {
+			if (first_new != 0) {
+				fat_remove_chain (first_new, old_last);
+				fat_chain_truncate (&inode->chain, have);
+				if (have == 0)
+					inode->data.start = 0;
+			}
+			return false;
+		}
+		if (first_new == 0)
+			first_new = clst;
+		if (inode->data.start == 0) {
+			inode->data.start = clst;
+			fat_chain_init (&inode->chain, clst);
+		}
+		zero_sectors (cluster_to_sector (clst), SECTORS_PER_CLUSTER);
+		last = clst;
+	}
+
+	inode->data.length = length;
+	write_inode (inode);
+	return true;
+}
+
+/* Gives back INODE's chain of clusters. */
+static void
+release_data (struct inode *inode) {
+	if (inode->data.start != 0)
+		fat_remove_chain (inode->data.start, 0);
+}
+
+/* Gives back INODE's own sector, and its data. */
+static void
+release_blocks (struct inode *inode) {
+	fat_remove_chain (sector_to_cluster (inode->sector), 0);
+	release_data (inode);
+}
+
+/* Sets up the in-memory part of INODE's data map, once its
+ * on-disk inode is read.  Returns false if memory runs out. */
+static bool
+open_map (struct inode *inode) {
+	fat_chain_init (&inode->chain, inode->data.start);
+	return true;
+}
+
+/* Frees what open_map() set up for INODE. */
+static void
+close_map (struct inode *inode) {
+	fat_chain_destroy (&inode->chain);
+}
+#else
+/* Returns extent I of INODE. */
+static struct extent *
+extent_at (const struct inode *inode, size_t i) {
+	ASSERT (i < inode->data.extent_cnt);
+	if (i < INLINE_EXTENTS)
+		return (struct extent *) &inode->data.extents[i];
+	return &inode->indirect->extents[i - INLINE_EXTENTS];
+}
+
+/* Returns the number of data sectors allocated to INODE, which may
+ * be more than its length needs after a failed growth. */
+static size_t
+allocated_sectors (const struct inode *inode) {
+	size_t cnt = inode->data.extent_cnt;
+	struct extent *e;
+
+	if (cnt == 0)
+		return 0;
+	e = extent_at (inode, cnt - 1);
+	return e->first + e->cnt;
+}
+
 /* Returns the disk sector that contains byte offset POS within
  * INODE.
  * Returns -1 if INODE does not contain data for a byte at offset
  * POS. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) {
+byte_to_sector (struct inode *inode, off_t pos) {
+	size_t sector, lo, hi;
+	struct extent *e;
+
 	ASSERT (inode != NULL);
-	if (pos < inode->data.length)
-		return inode->data.start + pos / DISK_SECTOR_SIZE;
-	else
+	if (pos >= inode->data.length)
 		return -1;
+
+	/* Binary search for the last extent that starts at or before
+	 * the sector wanted. */
+	sector = pos / DISK_SECTOR_SIZE;
+	lo = 0;
+	hi = inode->data.extent_cnt;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+
+		if (extent_at (inode, mid)->first <= sector)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	e = extent_at (inode, lo);
+	ASSERT (sector - e->first < e->cnt);
+	return e->start + (sector - e->first);
+}
+
+/* Appends an extent of CNT sectors at START to INODE, allocating
+ * its indirect block first if it is needed now.  Returns false if
+ * INODE has no room for another extent. */
+static bool
+add_extent (struct inode *inode, disk_sector_t start, size_t cnt) {
+	size_t i = inode->data.extent_cnt;
+	size_t first = allocated_sectors (inode);
+	struct extent *e;
+
+	if (i == MAX_EXTENTS)
+		return false;
+	if (i == INLINE_EXTENTS && inode->indirect == NULL) {
+		inode->indirect = calloc (1, sizeof *inode->indirect);
+		if (inode->indirect == NULL)
+			return false;
+		if (!free_map_allocate (1, &inode->data.indirect)) {
+			free (inode->indirect);
+			inode->indirect = NULL;
+			return false;
+		}
+	}
+
+	inode->data.extent_cnt++;
+	e = extent_at (inode, i);
+	e->first = first;
+	e->start = start;
+	e->cnt = cnt;
+	return true;
+}
+
+/* Writes INODE's on-disk inode, and its indirect block if any. */
+static void
+write_inode (const struct inode *inode) {
+	disk_write (filesys_disk, inode->sector, &inode->data);
+	if (inode->indirect != NULL)
+		disk_write (filesys_disk, inode->data.indirect, inode->indirect);
+}
+
+/* Makes INODE LENGTH bytes long, if it is shorter, and writes it
+ * to disk.  New sectors are taken in runs as long as possible,
+ * first right after the last extent so that it just grows, and
+ * they read as zeros.  Returns false if the disk or INODE's
+ * extents run out, leaving its length as it was. */
+static bool
+inode_grow (struct inode *inode, off_t length) {
+	size_t have = allocated_sectors (inode);
+	size_t need = bytes_to_sectors (length);
+	bool success = true;
+
+	if (length <= inode->data.length)
+		return true;
+
+	while (have < need) {
+		size_t n = need - have;
+		struct extent *last = inode->data.extent_cnt > 0
+			? extent_at (inode, inode->data.extent_cnt - 1) : NULL;
+		disk_sector_t start;
+
+		if (last != NULL && free_map_allocate_at (last->start + last->cnt, n)) {
+			start = last->start + last->cnt;
+			last->cnt += n;
+		} else {
+			while (n > 0 && !free_map_allocate (n, &start))
+				n /= 2;
+			if (n == 0) {
+				success = false;
+				break;
+			}
+			if (!add_extent (inode, start, n)) {
+				free_map_release (start, n);
+				success = false;
+				break;
+			}
+		}
+		zero_sectors (start, n);
+		have += n;
+	}
+
+	if (success)
+		inode->data.length = length;
+	write_inode (inode);
+	return success;
+}
+
+/* Gives back every sector of INODE's data, and its indirect
+ * block. */
+static void
+release_data (struct inode *inode) {
+	for (size_t i = 0; i < inode->data.extent_cnt; i++) {
+		struct extent *e = extent_at (inode, i);
+
+		free_map_release (e->start, e->cnt);
+	}
+	if (inode->indirect != NULL)
+		free_map_release (inode->data.indirect, 1);
+}
+
+/* Gives back INODE's own sector, and its data. */
+static void
+release_blocks (struct inode *inode) {
+	free_map_release (inode->sector, 1);
+	release_data (inode);
+}
+
+/* Sets up the in-memory part of INODE's data map, once its
+ * on-disk inode is read.  Returns false if memory runs out. */
+static bool
+open_map (struct inode *inode) {
+	inode->indirect = NULL;
+	if (inode->data.extent_cnt > INLINE_EXTENTS) {
+		inode->indirect = malloc (sizeof *inode->indirect);
+		if (inode->indirect == NULL)
+			return false;
+		disk_read (filesys_disk, inode->data.indirect, inode->indirect);
+	}
+	return true;
+}
+
+/* Frees what open_map() set up for INODE. */
+static void
+close_map (struct inode *inode) {
+	free (inode->indirect);
+}
+#endif
+
+/* Stores in SECTORS the disk sector of each part of page IDX of
+ * INODE's data, or -1 for parts past its end. */
+static void
+page_sectors (struct inode *inode, size_t idx,
+		disk_sector_t sectors[SECTORS_PER_PAGE]) {
+	for (size_t i = 0; i < SECTORS_PER_PAGE; i++)
+		sectors[i] = byte_to_sector (inode,
+				idx * PGSIZE + i * DISK_SECTOR_SIZE);
+}
+
+/* Returns page IDX of INODE's data from the page cache, held until
+ * page_cache_put().  Unless FILL is false, it is read in if it is
+ * not cached. */
+static void *
+get_page (struct inode *inode, size_t idx, bool fill) {
+	disk_sector_t sectors[SECTORS_PER_PAGE];
+
+	page_sectors (inode, idx, sectors);
+	return page_cache_get (inode->sector, idx, sectors, fill);
 }
 
 /* List of open inodes, so that opening a single inode twice
@@ -66,32 +415,34 @@ inode_init (void) {
  * Returns false if memory or disk allocation fails. */
 bool
 inode_create (disk_sector_t sector, off_t length) {
-	struct inode_disk *disk_inode = NULL;
+	struct inode *inode = NULL;
 	bool success = false;
 
 	ASSERT (length >= 0);
 
-	/* If this assertion fails, the inode structure is not exactly
-	 * one sector in size, and you should fix that. */
-	ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
-
-	disk_inode = calloc (1, sizeof *disk_inode);
-	if (disk_inode != NULL) {
-		size_t sectors = bytes_to_sectors (length);
-		disk_inode->length = length;
-		disk_inode->magic = INODE_MAGIC;
-		if (free_map_allocate (sectors, &disk_inode->start)) {
-			disk_write (filesys_disk, sector, disk_inode);
-			if (sectors > 0) {
-				static char zeros[DISK_SECTOR_SIZE];
-				size_t i;
-
-				for (i = 0; i < sectors; i++) 
-					disk_write (filesys_disk, disk_inode->start + i, zeros); 
-			}
-			success = true; 
-		} 
-		free (disk_inode);
+	/* If these assertions fail, the inode structure or the indirect
+	 * block is not exactly one sector in size, and you should fix
+	 * that. */
+	ASSERT (sizeof (struct inode_disk) == DISK_SECTOR_SIZE);
+#ifndef EFILESYS
+	ASSERT (sizeof (struct extent_block) == DISK_SECTOR_SIZE);
+#endif
+
+	inode = calloc (1, sizeof *inode);
+	if (inode != NULL) {
+		inode->sector = sector;
+		inode->data.magic = INODE_MAGIC;
+		open_map (inode);
+		if (length == 0) {
+			write_inode (inode);
+			success = true;
+		} else {
+			success = inode_grow (inode, length);
+			if (!success)
+				release_data (inode);
+		}
+		close_map (inode);
+		free (inode);
 	}
 	return success;
 }
@@ -126,6 +477,11 @@ inode_open (disk_sector_t sector) {
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
 	disk_read (filesys_disk, inode->sector, &inode->data);
+	if (!open_map (inode)) {
+		list_remove (&inode->elem);
+		free (inode);
+		return NULL;
+	}
 	return inode;
 }
 
@@ -159,11 +515,11 @@ inode_close (struct inode *inode) {
 
 		/* Deallocate blocks if removed. */
 		if (inode->removed) {
-			free_map_release (inode->sector, 1);
-			free_map_release (inode->data.start,
-					bytes_to_sectors (inode->data.length)); 
+			page_cache_invalidate (inode->sector);
+			release_blocks (inode);
 		}
 
+		close_map (inode);
 		free (inode); 
 	}
 }
@@ -174,6 +530,9 @@ void
 inode_remove (struct inode *inode) {
 	ASSERT (inode != NULL);
 	inode->removed = true;
+#ifdef VM
+	vm_text_forget (inode);
+#endif
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -183,110 +542,113 @@ off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 	uint8_t *buffer = buffer_;
 	off_t bytes_read = 0;
-	uint8_t *bounce = NULL;
 
 	while (size > 0) {
-		/* Disk sector to read, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
-		int sector_ofs = offset % DISK_SECTOR_SIZE;
+		/* Page to read, starting byte offset within page. */
+		size_t page_idx = offset / PGSIZE;
+		int page_ofs = offset % PGSIZE;
 
-		/* Bytes left in inode, bytes left in sector, lesser of the two. */
+		/* Bytes left in inode, bytes left in page, lesser of the two. */
 		off_t inode_left = inode_length (inode) - offset;
-		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-		int min_left = inode_left < sector_left ? inode_left : sector_left;
+		int page_left = PGSIZE - page_ofs;
+		int min_left = inode_left < page_left ? inode_left : page_left;
 
-		/* Number of bytes to actually copy out of this sector. */
+		/* Number of bytes to actually copy out of this page. */
 		int chunk_size = size < min_left ? size : min_left;
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Read full sector directly into caller's buffer. */
-			disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
-		} else {
-			/* Read sector into bounce buffer, then partially copy
-			 * into caller's buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-			disk_read (filesys_disk, sector_idx, bounce);
-			memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-		}
+		uint8_t *kpage = get_page (inode, page_idx, true);
+		memcpy (buffer + bytes_read, kpage + page_ofs, chunk_size);
+		page_cache_put (kpage, 0, 0);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_read += chunk_size;
 	}
-	free (bounce);
 
 	return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+ * A write past end of file extends the inode first, and the gap
+ * between the two, if any, reads as zeros.
  * Returns the number of bytes actually written, which may be
- * less than SIZE if end of file is reached or an error occurs.
- * (Normally a write at end of file would extend the inode, but
- * growth is not yet implemented.) */
+ * less than SIZE if the disk is full or an error occurs. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		off_t offset) {
 	const uint8_t *buffer = buffer_;
 	off_t bytes_written = 0;
-	uint8_t *bounce = NULL;
 
 	if (inode->deny_write_cnt)
 		return 0;
+#ifdef VM
+	/* Program text shared from this file would go stale. */
+	if (size > 0)
+		vm_text_forget (inode);
+#endif
+	if (size > 0 && offset + size > inode_length (inode))
+		inode_grow (inode, offset + size);
 
 	while (size > 0) {
-		/* Sector to write, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
-		int sector_ofs = offset % DISK_SECTOR_SIZE;
+		/* Page to write, starting byte offset within page. */
+		size_t page_idx = offset / PGSIZE;
+		int page_ofs = offset % PGSIZE;
 
-		/* Bytes left in inode, bytes left in sector, lesser of the two. */
+		/* Bytes left in inode, bytes left in page, lesser of the two. */
 		off_t inode_left = inode_length (inode) - offset;
-		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-		int min_left = inode_left < sector_left ? inode_left : sector_left;
+		int page_left = PGSIZE - page_ofs;
+		int min_left = inode_left < page_left ? inode_left : page_left;
 
-		/* Number of bytes to actually write into this sector. */
+		/* Number of bytes to actually write into this page. */
 		int chunk_size = size < min_left ? size : min_left;
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Write full sector directly to disk. */
-			disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
-		} else {
-			/* We need a bounce buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-
-			/* If the sector contains data before or after the chunk
-			   we're writing, then we need to read in the sector
-			   first.  Otherwise we start with a sector of all zeros. */
-			if (sector_ofs > 0 || chunk_size < sector_left) 
-				disk_read (filesys_disk, sector_idx, bounce);
-			else
-				memset (bounce, 0, DISK_SECTOR_SIZE);
-			memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-			disk_write (filesys_disk, sector_idx, bounce); 
-		}
+		/* A page that is written whole need not be read first.  The
+		   source may be the cached page itself, when a process
+		   writes back a page it maps from the cache. */
+		uint8_t *kpage = get_page (inode, page_idx, chunk_size < PGSIZE);
+		memmove (kpage + page_ofs, buffer + bytes_written, chunk_size);
+		page_cache_put (kpage, page_ofs, chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_written += chunk_size;
 	}
-	free (bounce);
 
 	return bytes_written;
 }
 
+/* Starts reading up to CNT pages of INODE's data, from page IDX
+ * on, into the page cache, without waiting for them.  Stops at the
+ * end of the file, or when the cache has no free page. */
+void
+inode_readahead (struct inode *inode, size_t idx, size_t cnt) {
+	disk_sector_t sectors[SECTORS_PER_PAGE];
+
+	for (; cnt > 0 && (off_t) (idx * PGSIZE) < inode_length (inode);
+			idx++, cnt--) {
+		page_sectors (inode, idx, sectors);
+		if (!page_cache_readahead (inode->sector, idx, sectors))
+			break;
+	}
+}
+
+/* Returns the page cache's copy of page IDX of INODE's data, held
+ * as by page_cache_get(), for a process to map, or a null pointer
+ * if the cache has no page to spare for that. */
+void *
+inode_share_page (struct inode *inode, size_t idx) {
+	disk_sector_t sectors[SECTORS_PER_PAGE];
+
+	page_sectors (inode, idx, sectors);
+	return page_cache_share (inode->sector, idx, sectors);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 	void
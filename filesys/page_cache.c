@@ -1,50 +1,556 @@
-/* page_cache.c: Implementation of Page Cache (Buffer Cache). */
+/* page_cache.c: Implementation of Page Cache (Buffer Cache).
+ *
+ * File data is cached a page at a time, keyed by the inode number
+ * of the file and the index of the page in it, in a pool of
+ * page_cache_pages kernel pages set aside at boot.  inode_read_at()
+ * and inode_write_at() both go through it.  With VM, a page of an
+ * mmap region is mapped to the cached page itself, rather than to
+ * a copy, so that a file read by one process and mapped by another
+ * is in memory only once.
+ *
+ * A cached page is held by one thread at a time, between
+ * page_cache_get() and page_cache_put(), and it is also held while
+ * it is read from the disk.  A clock hand picks the page to reuse
+ * on a miss, skipping held pages and pages that a process maps.
+ *
+ * Writes are behind: a write only marks the sectors it touched
+ * dirty.  The flusher thread, page_cache_kworkerd(), writes them
+ * back every page_cache_flush_ticks ticks, sorted by sector so that
+ * runs of them go in one command each, and filesys_done() does the
+ * same at shutdown.  A dirty page picked for reuse is written back
+ * first.  With page_cache_flush_ticks at 0, writes go straight
+ * through to the disk instead.
+ *
+ * Reads ahead are asynchronous: page_cache_readahead() takes a
+ * page for the data and queues it, still held, for the readahead
+ * thread, so that a reader who gets there first waits only for the
+ * rest of that read. */
 
+#include "filesys/page_cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#ifdef VM
 #include "vm/vm.h"
-static bool page_cache_readahead (struct page *page, void *kva);
-static bool page_cache_writeback (struct page *page);
-static void page_cache_destroy (struct page *page);
-
-/* DO NOT MODIFY this struct */
-static const struct page_operations page_cache_op = {
-	.swap_in = page_cache_readahead,
-	.swap_out = page_cache_writeback,
-	.destroy = page_cache_destroy,
-	.type = VM_PAGE_CACHE,
+#endif
+
+size_t page_cache_pages = 32;
+size_t page_cache_flush_ticks = 5 * TIMER_FREQ;
+
+/* Most sectors written back in one command. */
+#define FLUSH_RUN 64
+
+/* A page of the pool. */
+struct cache_page {
+	struct hash_elem elem;      /* Element in cache_map, if in use. */
+	disk_sector_t inumber;      /* Inode of the file cached here... */
+	size_t idx;                 /* ...and index of the page in it. */
+	disk_sector_t sectors[SECTORS_PER_PAGE];  /* Where each sector of
+	                                             the page is, or -1. */
+	uint8_t dirty;              /* Sectors not written back, a bit each. */
+	bool in_use;                /* Does it hold a page of a file? */
+	bool held;                  /* Between get and put? */
+	bool accessed;              /* Used since the clock hand passed? */
+	bool read_ahead;            /* Read ahead, and not used since? */
+	struct list_elem ra_elem;   /* Element in ra_queue. */
+};
+
+static struct lock cache_lock;      /* Protects everything below. */
+static struct condition cache_cond; /* Signaled when a page is put. */
+static struct hash cache_map;       /* Pages in use, by file and index. */
+static struct cache_page *cache;    /* One per pool page. */
+static uint8_t *pool;               /* The pool pages, contiguous. */
+static size_t clock_hand;           /* Next page to look at for reuse. */
+
+/* A dirty sector being written back. */
+struct dirty_sector {
+	disk_sector_t sector;       /* Where it goes... */
+	const uint8_t *data;        /* ...and where it is in the pool. */
 };
 
+/* State of page_cache_writeback(), set up once. */
+static struct lock flush_lock;      /* One writeback at a time. */
+static struct cache_page **flush_pages;     /* Pages being written. */
+static struct dirty_sector *flush_sectors;  /* Their dirty sectors. */
+static uint8_t *flush_bounce;       /* FLUSH_RUN sectors. */
+
 tid_t page_cache_workerd;
 
-/* The initializer of file vm */
-void
-pagecache_init (void) {
-	/* TODO: Create a worker daemon for page cache with page_cache_kworkerd */
+/* Pages waiting for the readahead thread, which ups ra_sema once
+ * for each. */
+static struct list ra_queue;
+static struct semaphore ra_sema;
+
+/* Statistics. */
+static long long hit_cnt;           /* Pages found in the cache. */
+static long long miss_cnt;          /* Pages that were not. */
+static long long share_cnt;         /* Pages handed out to be mapped. */
+static long long flush_sector_cnt;  /* Dirty sectors written back... */
+static long long flush_run_cnt;     /* ...in this many commands. */
+static long long evict_write_cnt;   /* Dirty pages written for reuse. */
+static long long ra_page_cnt;       /* Pages read ahead... */
+static long long ra_hit_cnt;        /* ...and used later. */
+
+static void page_cache_kworkerd (void *aux);
+static void page_cache_kreadaheadd (void *aux);
+
+/* Returns the kernel address of CP's page. */
+static uint8_t *
+cache_kva (const struct cache_page *cp) {
+	return pool + (cp - cache) * PGSIZE;
 }
 
-/* Initialize the page cache */
-bool
-page_cache_initializer (struct page *page, enum vm_type type, void *kva) {
-	/* Set up the handler */
-	page->operations = &page_cache_op;
+/* Returns the pool page at kernel address KVA. */
+static struct cache_page *
+cache_page_of (const void *kva) {
+	size_t i = ((const uint8_t *) kva - pool) / PGSIZE;
 
+	ASSERT (i < page_cache_pages);
+	return &cache[i];
 }
 
-/* Utilze the Swap in mechanism to implement readhead */
+/* Returns true if a process maps CP's page.  A page only becomes
+ * mapped while it is held, so a false answer holds until the next
+ * get, as long as cache_lock is. */
 static bool
-page_cache_readahead (struct page *page, void *kva) {
+cache_page_mapped (const struct cache_page *cp UNUSED) {
+#ifdef VM
+	return frame_of (cache_kva (cp))->ref_cnt > 0;
+#else
+	return false;
+#endif
+}
+
+static uint64_t
+cache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct cache_page *cp = hash_entry (e, struct cache_page, elem);
+	uint64_t key[] = { cp->inumber, cp->idx };
+
+	return hash_bytes (key, sizeof key);
 }
 
-/* Utilze the Swap out mechanism to implement writeback */
 static bool
-page_cache_writeback (struct page *page) {
+cache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct cache_page *a = hash_entry (a_, struct cache_page, elem);
+	const struct cache_page *b = hash_entry (b_, struct cache_page, elem);
+
+	if (a->inumber != b->inumber)
+		return a->inumber < b->inumber;
+	return a->idx < b->idx;
+}
+
+/* Sets up a cache of page_cache_pages pages.  Called by
+ * filesys_init(), and again by vm_init() when both are built. */
+void
+pagecache_init (void) {
+	if (cache != NULL)
+		return;
+
+	lock_init (&cache_lock);
+	cond_init (&cache_cond);
+	lock_init (&flush_lock);
+	list_init (&ra_queue);
+	sema_init (&ra_sema, 0);
+	if (page_cache_pages == 0)
+		page_cache_pages = 1;
+	cache = calloc (page_cache_pages, sizeof *cache);
+	pool = palloc_get_multiple (0, page_cache_pages);
+	flush_pages = calloc (page_cache_pages, sizeof *flush_pages);
+	flush_sectors = calloc (page_cache_pages * SECTORS_PER_PAGE,
+			sizeof *flush_sectors);
+	flush_bounce = palloc_get_multiple (0, FLUSH_RUN / SECTORS_PER_PAGE);
+	if (cache == NULL || pool == NULL || flush_pages == NULL
+			|| flush_sectors == NULL || flush_bounce == NULL
+			|| !hash_init (&cache_map, cache_hash, cache_less, NULL))
+		PANIC ("pagecache_init: cannot set up a %zu-page cache",
+				page_cache_pages);
+
+#ifdef VM
+	/* The frame table may map these frames, but must neither evict
+	 * nor free them. */
+	for (size_t i = 0; i < page_cache_pages; i++) {
+		struct frame *frame = frame_of (pool + i * PGSIZE);
+
+		frame->flags = FRAME_CACHE;
+		frame->pin_cnt = 1;
+	}
+#endif
+
+	if (page_cache_flush_ticks > 0) {
+		page_cache_workerd = thread_create ("kworkerd", PRI_DEFAULT,
+				page_cache_kworkerd, NULL);
+		if (page_cache_workerd == TID_ERROR)
+			PANIC ("pagecache_init: cannot start the flusher");
+	}
+	if (thread_create ("kreadaheadd", PRI_DEFAULT, page_cache_kreadaheadd,
+				NULL) == TID_ERROR)
+		PANIC ("pagecache_init: cannot start the readahead thread");
 }
 
-/* Destory the page_cache. */
+/* Returns a page that may be reused for another file page, or a
+ * null pointer if every page is held or mapped.  The clock hand
+ * gives a page accessed since it last passed a second chance.
+ * cache_lock must be held. */
+static struct cache_page *
+pick_victim (void) {
+	for (size_t n = 0; n < 2 * page_cache_pages; n++) {
+		struct cache_page *cp = &cache[clock_hand];
+
+		clock_hand = (clock_hand + 1) % page_cache_pages;
+		if (cp->held || cache_page_mapped (cp))
+			continue;
+		if (cp->accessed)
+			cp->accessed = false;
+		else
+			return cp;
+	}
+	return NULL;
+}
+
+/* Makes CP, which is not held, the page for page IDX of the file
+ * whose inode is in sector INUMBER.  cache_lock must be held. */
 static void
-page_cache_destroy (struct page *page) {
+rekey (struct cache_page *cp, disk_sector_t inumber, size_t idx) {
+	ASSERT (cp->dirty == 0);
+
+	if (cp->in_use)
+		hash_delete (&cache_map, &cp->elem);
+	cp->inumber = inumber;
+	cp->idx = idx;
+	cp->in_use = true;
+	cp->read_ahead = false;
+	hash_insert (&cache_map, &cp->elem);
 }
 
-/* Worker thread for page cache */
+/* Reads the page of CP from the disk, each run of consecutive
+ * sectors with one command.  Sectors past the end of the file read
+ * as zeros.  CP must be held. */
 static void
-page_cache_kworkerd (void *aux) {
+read_page (struct cache_page *cp) {
+	uint8_t *kva = cache_kva (cp);
+
+	for (size_t i = 0, n; i < SECTORS_PER_PAGE; i += n) {
+		n = 1;
+		if (cp->sectors[i] == (disk_sector_t) -1) {
+			memset (kva + i * DISK_SECTOR_SIZE, 0, DISK_SECTOR_SIZE);
+			continue;
+		}
+		while (i + n < SECTORS_PER_PAGE
+				&& cp->sectors[i + n] == cp->sectors[i] + n)
+			n++;
+		disk_read_sectors (filesys_disk, cp->sectors[i],
+				kva + i * DISK_SECTOR_SIZE, n);
+	}
+}
+
+/* Starts reading page IDX of the file whose inode is in sector
+ * INUMBER into the cache, as page_cache_get() would, but without
+ * waiting for it.  Only a clean page that is free right now is
+ * used for it.  Returns false if there is none; true if the read
+ * was queued, or the page is cached already. */
+bool
+page_cache_readahead (disk_sector_t inumber, size_t idx,
+		const disk_sector_t sectors[]) {
+	struct cache_page key = { .inumber = inumber, .idx = idx };
+	struct cache_page *cp;
+
+	lock_acquire (&cache_lock);
+	if (hash_find (&cache_map, &key.elem) != NULL) {
+		lock_release (&cache_lock);
+		return true;
+	}
+	cp = pick_victim ();
+	if (cp == NULL || cp->dirty != 0) {
+		lock_release (&cache_lock);
+		return false;
+	}
+	rekey (cp, inumber, idx);
+	cp->held = true;
+	cp->read_ahead = true;
+	memcpy (cp->sectors, sectors, sizeof cp->sectors);
+	list_push_back (&ra_queue, &cp->ra_elem);
+	ra_page_cnt++;
+	lock_release (&cache_lock);
+	sema_up (&ra_sema);
+	return true;
+}
+
+/* The readahead thread.  The pages it reads stay unaccessed, so
+ * the clock hand takes them first if nobody uses them. */
+static void
+page_cache_kreadaheadd (void *aux UNUSED) {
+	for (;;) {
+		struct cache_page *cp;
+
+		sema_down (&ra_sema);
+		lock_acquire (&cache_lock);
+		cp = list_entry (list_pop_front (&ra_queue), struct cache_page, ra_elem);
+		lock_release (&cache_lock);
+
+		read_page (cp);
+
+		lock_acquire (&cache_lock);
+		cp->held = false;
+		cond_broadcast (&cache_cond, &cache_lock);
+		lock_release (&cache_lock);
+	}
+}
+
+/* Writes the sectors of CP whose bits are set in MASK, each run of
+ * consecutive sectors in one command.  CP must be held. */
+static void
+write_sectors (struct cache_page *cp, uint8_t mask) {
+	for (size_t i = 0, n; i < SECTORS_PER_PAGE; i += n) {
+		n = 1;
+		if (!(mask & (1 << i)))
+			continue;
+		ASSERT (cp->sectors[i] != (disk_sector_t) -1);
+		while (i + n < SECTORS_PER_PAGE && (mask & (1 << (i + n)))
+				&& cp->sectors[i + n] == cp->sectors[i] + n)
+			n++;
+		disk_write_sectors (filesys_disk, cp->sectors[i],
+				cache_kva (cp) + i * DISK_SECTOR_SIZE, n);
+	}
+}
+
+/* Returns the number of pages that processes map now.  cache_lock
+ * must be held. */
+static size_t
+mapped_cnt (void) {
+	size_t cnt = 0;
+
+	for (size_t i = 0; i < page_cache_pages; i++)
+		cnt += cache_page_mapped (&cache[i]);
+	return cnt;
+}
+
+/* Does the work of page_cache_get() and page_cache_share().  If
+ * SHARE, returns a null pointer instead once half the pool is
+ * mapped, so that reads and writes always find a page to use. */
+static void *
+cache_get (disk_sector_t inumber, size_t idx, const disk_sector_t sectors[],
+		bool fill, bool share) {
+	struct cache_page key = { .inumber = inumber, .idx = idx };
+	struct cache_page *cp;
+	bool miss;
+
+	lock_acquire (&cache_lock);
+	if (share && mapped_cnt () >= page_cache_pages / 2) {
+		lock_release (&cache_lock);
+		return NULL;
+	}
+	for (;;) {
+		struct hash_elem *e = hash_find (&cache_map, &key.elem);
+
+		if (e != NULL) {
+			cp = hash_entry (e, struct cache_page, elem);
+			if (!cp->held) {
+				miss = false;
+				break;
+			}
+		} else if ((cp = pick_victim ()) != NULL) {
+			if (cp->dirty != 0) {
+				/* Write it back, then look again, since someone may
+				 * have brought in the page wanted meanwhile. */
+				cp->held = true;
+				lock_release (&cache_lock);
+				write_sectors (cp, cp->dirty);
+				cp->dirty = 0;
+				lock_acquire (&cache_lock);
+				cp->held = false;
+				evict_write_cnt++;
+				cond_broadcast (&cache_cond, &cache_lock);
+				continue;
+			}
+			rekey (cp, inumber, idx);
+			miss = true;
+			break;
+		}
+		cond_wait (&cache_cond, &cache_lock);
+	}
+	cp->held = true;
+	cp->accessed = true;
+	memcpy (cp->sectors, sectors, sizeof cp->sectors);
+	if (miss)
+		miss_cnt++;
+	else
+		hit_cnt++;
+	if (cp->read_ahead) {
+		cp->read_ahead = false;
+		ra_hit_cnt++;
+	}
+	if (share)
+		share_cnt++;
+	lock_release (&cache_lock);
+
+	if (miss && fill)
+		read_page (cp);
+	return cache_kva (cp);
+}
+
+/* Returns the kernel address of the cached copy of page IDX of the
+ * file whose inode is in sector INUMBER, held for the caller until
+ * page_cache_put().  SECTORS gives the sector of each part of the
+ * page, or -1 past the end of the file.  If the page is not
+ * cached, it is read in, unless FILL is false because the caller
+ * is about to write all of it. */
+void *
+page_cache_get (disk_sector_t inumber, size_t idx,
+		const disk_sector_t sectors[], bool fill) {
+	return cache_get (inumber, idx, sectors, fill, false);
+}
+
+/* Like page_cache_get(), but for a process to map the page.
+ * Returns a null pointer if too much of the cache is mapped
+ * already. */
+void *
+page_cache_share (disk_sector_t inumber, size_t idx,
+		const disk_sector_t sectors[]) {
+	return cache_get (inumber, idx, sectors, true, true);
+}
+
+/* Releases the cached page at KVA, which the caller held.  If SIZE
+ * is nonzero, the caller modified the SIZE bytes at offset OFS in
+ * the page, and the sectors they are in become dirty. */
+void
+page_cache_put (void *kva, off_t ofs, off_t size) {
+	struct cache_page *cp = cache_page_of (kva);
+
+	ASSERT (cp->held);
+	if (size > 0) {
+		size_t first = ofs / DISK_SECTOR_SIZE;
+		size_t end = (ofs + size - 1) / DISK_SECTOR_SIZE + 1;
+		uint8_t mask = ((1 << end) - 1) & ~((1 << first) - 1);
+
+		if (page_cache_flush_ticks > 0)
+			cp->dirty |= mask;
+		else
+			write_sectors (cp, mask);
+	}
+
+	lock_acquire (&cache_lock);
+	cp->held = false;
+	cond_broadcast (&cache_cond, &cache_lock);
+	lock_release (&cache_lock);
+}
+
+/* Drops the cached pages of the file whose inode is in sector
+ * INUMBER, which is being deleted. */
+void
+page_cache_invalidate (disk_sector_t inumber) {
+	lock_acquire (&cache_lock);
+	for (size_t i = 0; i < page_cache_pages; i++) {
+		struct cache_page *cp = &cache[i];
+
+		while (cp->in_use && cp->inumber == inumber && cp->held)
+			cond_wait (&cache_cond, &cache_lock);
+		if (cp->in_use && cp->inumber == inumber) {
+			hash_delete (&cache_map, &cp->elem);
+			cp->in_use = false;
+			cp->accessed = false;
+			cp->dirty = 0;
+		}
+	}
+	lock_release (&cache_lock);
+}
+
+/* Orders dirty sectors by sector number. */
+static int
+compare_sector (const void *a_, const void *b_) {
+	const struct dirty_sector *a = a_;
+	const struct dirty_sector *b = b_;
+
+	return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes back every dirty page that is not held right now.  All of
+ * their dirty sectors are sorted by sector number, and each run of
+ * consecutive ones, up to FLUSH_RUN sectors, is written with one
+ * command, through a bounce buffer if the run is not contiguous in
+ * the pool. */
+void
+page_cache_writeback (void) {
+	size_t page_cnt = 0, sector_cnt = 0;
+
+	lock_acquire (&flush_lock);
+	lock_acquire (&cache_lock);
+	for (size_t i = 0; i < page_cache_pages; i++) {
+		struct cache_page *cp = &cache[i];
+
+		if (cp->dirty == 0 || cp->held)
+			continue;
+		cp->held = true;
+		flush_pages[page_cnt++] = cp;
+		for (size_t s = 0; s < SECTORS_PER_PAGE; s++)
+			if (cp->dirty & (1 << s)) {
+				struct dirty_sector *d = &flush_sectors[sector_cnt++];
+
+				d->sector = cp->sectors[s];
+				d->data = cache_kva (cp) + s * DISK_SECTOR_SIZE;
+			}
+		cp->dirty = 0;
+	}
+	lock_release (&cache_lock);
+
+	qsort (flush_sectors, sector_cnt, sizeof *flush_sectors, compare_sector);
+	for (size_t i = 0, n; i < sector_cnt; i += n) {
+		struct dirty_sector *run = flush_sectors + i;
+		bool contiguous = true;
+
+		for (n = 1; i + n < sector_cnt && n < FLUSH_RUN; n++) {
+			if (run[n].sector != run[0].sector + n)
+				break;
+			if (run[n].data != run[0].data + n * DISK_SECTOR_SIZE)
+				contiguous = false;
+		}
+		if (contiguous)
+			disk_write_sectors (filesys_disk, run[0].sector, run[0].data, n);
+		else {
+			for (size_t j = 0; j < n; j++)
+				memcpy (flush_bounce + j * DISK_SECTOR_SIZE, run[j].data,
+						DISK_SECTOR_SIZE);
+			disk_write_sectors (filesys_disk, run[0].sector, flush_bounce, n);
+		}
+		flush_run_cnt++;
+	}
+	flush_sector_cnt += sector_cnt;
+
+	lock_acquire (&cache_lock);
+	for (size_t i = 0; i < page_cnt; i++)
+		flush_pages[i]->held = false;
+	cond_broadcast (&cache_cond, &cache_lock);
+	lock_release (&cache_lock);
+	lock_release (&flush_lock);
+}
+
+/* The flusher. */
+static void
+page_cache_kworkerd (void *aux UNUSED) {
+	for (;;) {
+		timer_sleep (page_cache_flush_ticks);
+		page_cache_writeback ();
+	}
+}
+
+/* Prints page cache statistics. */
+void
+page_cache_print_stats (void) {
+	printf ("Page cache: %zu pages, %lld hits, %lld misses, "
+			"%lld pages mapped by processes\n",
+			page_cache_pages, hit_cnt, miss_cnt, share_cnt);
+	printf ("Page cache: %lld dirty sectors written back in %lld runs, "
+			"%lld dirty pages written for reuse\n",
+			flush_sector_cnt, flush_run_cnt, evict_write_cnt);
+	printf ("Page cache: %lld pages read ahead, %lld of them used\n",
+			ra_page_cnt, ra_hit_cnt);
 }
@@ -34,5 +34,32 @@ void fat_remove_chain (
 cluster_t fat_get (cluster_t clst);
 void fat_put (cluster_t clst, cluster_t val);
 disk_sector_t cluster_to_sector (cluster_t clst);
+cluster_t sector_to_cluster (disk_sector_t sector);
+
+/* Clusters of a chain between checkpoints. */
+#define FAT_CHAIN_STRIDE 32
+
+/* A cluster known to be at index IDX of a chain. */
+struct fat_checkpoint {
+	size_t idx;
+	cluster_t clst;
+};
+
+/* What is known of where the clusters of one chain are, so that
+ * finding one need not walk the chain from its start.  One per
+ * open inode. */
+struct fat_chain {
+	cluster_t start;                /* First cluster, or 0 if empty. */
+	size_t last_idx;                /* Index looked up last... */
+	cluster_t last_clst;            /* ...and its cluster. */
+	struct fat_checkpoint *ckpts;   /* Checkpoints, sorted by index. */
+	size_t ckpt_cnt;                /* Checkpoints in use... */
+	size_t ckpt_cap;                /* ...and allocated. */
+};
+
+void fat_chain_init (struct fat_chain *, cluster_t start);
+void fat_chain_destroy (struct fat_chain *);
+cluster_t fat_chain_lookup (struct fat_chain *, size_t idx);
+void fat_chain_truncate (struct fat_chain *, size_t len);
 
 #endif /* filesys/fat.h */
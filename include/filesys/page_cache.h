@@ -1,12 +1,31 @@
 #ifndef FILESYS_PAGE_CACHE_H
 #define FILESYS_PAGE_CACHE_H
-#include "vm/vm.h"
-
-struct page;
-enum vm_type;
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/disk.h"
+#include "filesys/off_t.h"
+#include "threads/vaddr.h"
 
 struct page_cache {};
 
-void page_cache_init (void);
-bool page_cache_initializer (struct page *page, enum vm_type type, void *kva);
+/* Disk sectors in a page of the page cache. */
+#define SECTORS_PER_PAGE (PGSIZE / DISK_SECTOR_SIZE)
+
+/* -pc=PAGES: Kernel pages set aside for the page cache.
+ * -wb=TICKS: Interval of writing back dirty cached data, or 0 to
+ * write it at once. */
+extern size_t page_cache_pages;
+extern size_t page_cache_flush_ticks;
+
+void pagecache_init (void);
+void *page_cache_get (disk_sector_t inumber, size_t idx,
+		const disk_sector_t sectors[], bool fill);
+void *page_cache_share (disk_sector_t inumber, size_t idx,
+		const disk_sector_t sectors[]);
+void page_cache_put (void *kva, off_t ofs, off_t size);
+bool page_cache_readahead (disk_sector_t inumber, size_t idx,
+		const disk_sector_t sectors[]);
+void page_cache_invalidate (disk_sector_t inumber);
+void page_cache_writeback (void);
+void page_cache_print_stats (void);
 #endif
@@ -36,6 +36,18 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* Extra for Project 3. */
+	SYS_MADVISE,                /* Advise on the use of a memory range. */
+};
+
+/* Advice for SYS_MADVISE. */
+enum {
+	MADV_NORMAL,                /* No special treatment. */
+	MADV_SEQUENTIAL,            /* Read ahead, and drop pages behind. */
+	MADV_WILLNEED,              /* Load pages while frames are free. */
+	MADV_POPULATE,              /* Load every page now. */
+	MADV_DONTNEED,              /* Evict the pages now. */
 };
 
 #endif /* lib/syscall-nr.h */
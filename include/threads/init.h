@@ -15,6 +15,9 @@ extern uint64_t *base_pml4;
 /* -q: Power off when kernel tasks complete? */
 extern bool power_off_when_done;
 
+/* -hp: Back 2 MB-aligned user regions with huge pages? */
+extern bool user_huge_pages;
+
 void power_off (void) NO_RETURN;
 
 #endif /* threads/init.h */
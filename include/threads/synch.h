@@ -34,6 +34,7 @@ void lock_acquire(struct lock *);
 bool lock_try_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_held_by_current_thread(const struct lock *);
+bool lock_is_held (const struct lock *);
 
 bool thread_compare_donate_priority(const struct list_elem *l, const struct list_elem *s, void *aux);
 
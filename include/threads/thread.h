@@ -115,6 +115,15 @@ struct thread {
 #ifdef VM
 	/* Table for whole virtual memory owned by thread. */
 	struct supplemental_page_table spt;
+	uint64_t user_rsp;                  /* User rsp on syscall entry. */
+
+	/* Owned by vm/vm.c, under its frame lock. */
+	size_t rss;                         /* Resident pages, shared ones too. */
+	size_t rss_peak;                    /* Highest RSS so far. */
+	size_t ws_cur;                      /* Pages seen accessed in pass... */
+	size_t ws_epoch;                    /* ...number WS_EPOCH. */
+	size_t wss;                         /* Working set of the last pass. */
+	size_t wss_peak;                    /* Largest working set so far. */
 #endif
 
 	/* Owned by thread.c. */
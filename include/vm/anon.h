@@ -1,13 +1,22 @@
 #ifndef VM_ANON_H
 #define VM_ANON_H
 #include "vm/vm.h"
+#include "vm/zswap.h"
 struct page;
 enum vm_type;
 
+/* Slot value of a page that is not in swap. */
+#define NO_SLOT SIZE_MAX
+
 struct anon_page {
+	size_t slot;            /* Swap slot holding the page, or NO_SLOT. */
+	size_t zhandle;         /* Place in the zswap pool, or NO_ZHANDLE. */
 };
 
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+bool anon_swap_out_batch (struct page *pages[], size_t cnt);
+size_t anon_swap_neighbors (struct page *page, struct page *out[], size_t max);
+void vm_anon_print_stats (void);
 
 #endif
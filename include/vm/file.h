@@ -4,9 +4,18 @@
 #include "vm/vm.h"
 
 struct page;
+struct supplemental_page_table;
 enum vm_type;
 
+/* A page backed by part of a file.  The same structure, allocated
+ * with malloc(), is the aux of every lazily loaded page until its
+ * first fault, whether it becomes a file or an anonymous page. */
 struct file_page {
+	struct file *file;      /* Own reopened handle of the file. */
+	off_t ofs;              /* Offset of the page in FILE. */
+	size_t read_bytes;      /* Bytes read from FILE; the rest is zero. */
+	void *map_base;         /* First page of the mmap region, if any. */
+	size_t map_len;         /* Length of that region in bytes. */
 };
 
 void vm_file_init (void);
@@ -14,4 +23,7 @@ bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
 void *do_mmap(void *addr, size_t length, int writable,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
+void vm_file_writeback (struct supplemental_page_table *spt, void *start,
+		void *end);
+void vm_file_print_stats (void);
 #endif
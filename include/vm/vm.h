@@ -2,6 +2,7 @@
 #define VM_VM_H
 #include <stdbool.h>
 #include "threads/palloc.h"
+#include "threads/vaddr.h"
 
 enum vm_type {
 	/* page not initialized */
@@ -31,7 +32,9 @@ enum vm_type {
 #include "filesys/page_cache.h"
 #endif
 
+struct inode;
 struct page_operations;
+struct text_frame;
 struct thread;
 
 #define VM_TYPE(type) ((type) & 7)
@@ -46,6 +49,11 @@ struct page {
 	struct frame *frame;   /* Back reference for frame */
 
 	/* Your implementation */
+	struct thread *owner;  /* Process whose address space holds VA. */
+	bool writable;         /* May the user write to the page? */
+	struct page *next_sharer;  /* Next page sharing FRAME, if any. */
+	bool sequential;       /* Under MADV_SEQUENTIAL? */
+	bool referenced;       /* Accessed, as seen by the working set scan. */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -59,12 +67,47 @@ struct page {
 	};
 };
 
-/* The representation of "frame" */
+/* The representation of "frame".
+ * Every physical page has one of these in mem_map[], built by
+ * palloc_init() and indexed by page frame number, so there is no
+ * allocation per frame and frame_of() is plain arithmetic.
+ *
+ * A frame may be shared by several pages, e.g. after fork; they
+ * are chained from PAGE through their next_sharer members, and
+ * mapped read-only until each gets a private copy on its first
+ * write.
+ *
+ * The frames under a 2 MB mapping of user memory each still belong
+ * to one page, and are marked FRAME_HUGE.
+ *
+ * The frames of the page cache (filesys/page_cache.c) are marked
+ * FRAME_CACHE and pinned for good.  The cache owns them, and mmap
+ * pages may be mapped to them, but they are never evicted or freed
+ * here. */
 struct frame {
-	void *kva;
-	struct page *page;
+	void *kva;              /* Kernel virtual address of the frame. */
+	struct page *page;      /* First page sharing the frame, if any. */
+	uint32_t ref_cnt;       /* Number of pages sharing the frame. */
+	uint16_t pin_cnt;       /* If nonzero, must not be evicted. */
+	uint16_t flags;         /* FRAME_* bits below. */
+	struct text_frame *text;  /* Entry in the text index, if any. */
 };
 
+/* Frame flags. */
+#define FRAME_LOCKED 0x1    /* Contents in transit to/from storage. */
+#define FRAME_HUGE 0x2      /* Part of a 2 MB mapping. */
+#define FRAME_CACHE 0x4     /* Page of the page cache. */
+
+/* Descriptors of all physical frames, indexed by frame number. */
+extern struct frame *mem_map;
+extern size_t mem_map_cnt;
+
+/* Returns the descriptor of the frame at kernel address KVA. */
+static inline struct frame *
+frame_of (const void *kva) {
+	return &mem_map[pg_no (vtop (kva))];
+}
+
 /* The function table for page operations.
  * This is one way of implementing "interface" in C.
  * Put the table of "method" into the struct's member, and
@@ -82,11 +125,25 @@ struct page_operations {
 	if ((page)->operations->destroy) (page)->operations->destroy (page)
 
 /* Representation of current process's memory space.
- * We don't want to force you to obey any specific design for this struct.
- * All designs up to you for this. */
+ *
+ * The table is a radix tree laid out like the x86-64 page table
+ * itself: four levels of page-sized nodes of SPT_FANOUT slots,
+ * indexed by the PML4, PDPE, PDX and PTX bits of the address.  A
+ * lookup is always four loads with no hashing, and walking the
+ * slots in order visits the pages in address order, which fork,
+ * munmap and process exit rely on.  Interior nodes are only freed
+ * when the whole table is killed. */
+#define SPT_FANOUT (PGSIZE / sizeof (void *))
+
 struct supplemental_page_table {
+	void **root;           /* Top-level node, null while empty. */
+	size_t page_cnt;       /* Number of pages in the table. */
 };
 
+/* Called by spt_for_each() on each page in a range.  Returning
+ * false stops the walk.  FUNC may remove the page it is given. */
+typedef bool spt_page_func (struct page *, void *aux);
+
 #include "threads/thread.h"
 void supplemental_page_table_init (struct supplemental_page_table *spt);
 bool supplemental_page_table_copy (struct supplemental_page_table *dst,
@@ -96,8 +153,29 @@ struct page *spt_find_page (struct supplemental_page_table *spt,
 		void *va);
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
+bool spt_for_each (struct supplemental_page_table *spt, void *start,
+		void *end, spt_page_func *func, void *aux);
+
+/* -fa=PAGES: Window of program text loaded around a fault. */
+extern size_t fault_around_pages;
+
+/* -wl=PAGES, -wh=PAGES: Free frame watermarks of the reclaim daemon. */
+extern size_t reclaim_low_pages;
+extern size_t reclaim_high_pages;
+
+/* -ksm=PAGES: Frames scanned per second for identical anonymous
+ * pages to merge, or 0 to not merge them. */
+extern size_t ksm_pages_per_sec;
+
+/* -ws=MS: Interval of working set sampling, or 0 for none.
+ * -rss=PAGES: Soft limit on the resident pages of a process, or 0
+ * for none. */
+extern size_t ws_sample_ms;
+extern size_t rss_soft_limit;
 
 void vm_init (void);
+void vm_print_stats (void);
+void vm_print_rss (struct thread *t);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
 
@@ -107,6 +185,17 @@ bool vm_alloc_page_with_initializer (enum vm_type type, void *upage,
 		bool writable, vm_initializer *init, void *aux);
 void vm_dealloc_page (struct page *page);
 bool vm_claim_page (void *va);
+void vm_free_frame (struct page *page);
+void vm_clear_range (void *start, void *end);
+void vm_text_forget (struct inode *inode);
+bool vm_pin_page (struct page *page);
+void vm_unpin_page (struct page *page);
+bool vm_page_is_idle (struct page *page);
+bool vm_madvise (void *addr, size_t length, int advice);
+bool vm_pin_buffer (void *buffer, size_t size, bool write);
+void vm_unpin_buffer (void *buffer, size_t size);
+bool vm_lock_filesys (void);
+void vm_unlock_filesys (bool locked);
 enum vm_type page_get_type (struct page *page);
 
 #endif  /* VM_VM_H */
@@ -0,0 +1,19 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/* -zs=PAGES: Kernel pages set aside for compressed swap, or 0 to
+ * send every anonymous page straight to the swap disk. */
+extern size_t zswap_pool_pages;
+
+/* Handle of a page that is not in the compressed pool. */
+#define NO_ZHANDLE ((size_t) -1)
+
+void zswap_init (void);
+size_t zswap_store (const void *kva);
+void zswap_load (size_t handle, void *kva);
+void zswap_free (size_t handle);
+void zswap_print_stats (long long disk_loads);
+
+#endif
@@ -0,0 +1,100 @@
+/* Measures how much disk traffic the page cache saves, in the
+   spirit of bc-easy but on a larger file and with mixed patterns.
+
+   A FILE_SIZE file is written in small pieces, read back in
+   sector-sized pieces, rewritten one byte at a time at
+   pseudo-random offsets, and read back whole.  After each phase,
+   the bytes moved through read() and write() and the sectors the
+   disk moved are printed, so their ratio gives the throughput the
+   cache adds over going to the disk every time.  Write-behind
+   makes the write phases cost next to nothing until the flusher
+   runs; compare its "Page cache:" lines at power off, and the
+   "Timer:" line for the whole run.  Sector counts shift with the
+   flusher's timing from run to run; the program itself only fails
+   if the file reads back wrong.  Run it in filesys/build with
+   "pintos --fs-disk=10 -p tests/filesys/base/bc-bench:bc-bench
+   -- -q -f run bc-bench". */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (64 * 1024)
+#define SMALL_WRITE 100
+#define REWRITES 4096
+
+static const char file_name[] = "bench";
+static char buf[FILE_SIZE];
+static char check[FILE_SIZE];
+
+static long long read_base, write_base;
+
+/* Starts counting disk sectors for a phase. */
+static void
+start_phase (void)
+{
+  read_base = get_fs_disk_read_cnt ();
+  write_base = get_fs_disk_write_cnt ();
+}
+
+/* Prints the disk sectors moved since start_phase() for BYTES
+   bytes moved by the phase called NAME. */
+static void
+end_phase (const char *name, size_t bytes)
+{
+  msg ("%s: %zu bytes, %lld sectors read, %lld written", name, bytes,
+       get_fs_disk_read_cnt () - read_base,
+       get_fs_disk_write_cnt () - write_base);
+}
+
+void
+test_main (void)
+{
+  size_t ofs;
+  int fd, i;
+
+  CHECK (create (file_name, FILE_SIZE), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  start_phase ();
+  for (ofs = 0; ofs < FILE_SIZE; ofs += SMALL_WRITE)
+    {
+      size_t size = FILE_SIZE - ofs < SMALL_WRITE ? FILE_SIZE - ofs
+                                                  : SMALL_WRITE;
+      if (write (fd, buf + ofs, size) != (int) size)
+        fail ("write %zu bytes at offset %zu failed", size, ofs);
+    }
+  end_phase ("small writes", FILE_SIZE);
+
+  start_phase ();
+  seek (fd, 0);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += 512)
+    if (read (fd, check + ofs, 512) != 512)
+      fail ("read 512 bytes at offset %zu failed", ofs);
+  end_phase ("sector reads", FILE_SIZE);
+  compare_bytes (check, buf, FILE_SIZE, 0, file_name);
+
+  start_phase ();
+  for (i = 0; i < REWRITES; i++)
+    {
+      ofs = random_ulong () % FILE_SIZE;
+      buf[ofs] = i;
+      seek (fd, ofs);
+      if (write (fd, buf + ofs, 1) != 1)
+        fail ("write 1 byte at offset %zu failed", ofs);
+    }
+  end_phase ("byte rewrites", REWRITES);
+
+  start_phase ();
+  seek (fd, 0);
+  if (read (fd, check, FILE_SIZE) != FILE_SIZE)
+    fail ("read %d bytes failed", FILE_SIZE);
+  end_phase ("whole read", FILE_SIZE);
+  compare_bytes (check, buf, FILE_SIZE, 0, file_name);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
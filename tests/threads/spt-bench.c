@@ -0,0 +1,170 @@
+/* Microbenchmark of spt_find_page() and of walking the radix-tree
+   supplemental page table, against a hash table of pages built on
+   lib/kernel/hash.c, the usual design for this table.
+
+   Both tables are filled with the same pages, laid out like a
+   process: text, a large heap and a stack just below USER_STACK.
+   Then each is asked for the page under a long pseudo-random
+   sequence of fault addresses, and walked in full as fork and
+   exit do; only the radix tree walks in address order.  It all
+   runs in a kernel thread and takes no page faults, so the timer
+   ticks it prints cover the table operations alone, not the fault
+   path around them.  Run it with "pintos -- run spt-bench" in
+   vm/build. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
+
+#ifdef VM
+#include <hash.h>
+#include "vm/vm.h"
+
+#define TEXT_PAGES 512
+#define HEAP_PAGES 4096
+#define STACK_PAGES 256
+#define PAGE_CNT (TEXT_PAGES + HEAP_PAGES + STACK_PAGES)
+#define LOOKUPS (1 << 22)
+
+/* A page in the hash-based table. */
+struct hash_page
+  {
+    struct hash_elem elem;
+    void *va;
+  };
+
+static void *page_va[PAGE_CNT];
+
+static uint64_t
+hash_page_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct hash_page *p = hash_entry (e, struct hash_page, elem);
+  return hash_bytes (&p->va, sizeof p->va);
+}
+
+static bool
+hash_page_less (const struct hash_elem *a, const struct hash_elem *b,
+                void *aux UNUSED)
+{
+  return hash_entry (a, struct hash_page, elem)->va
+         < hash_entry (b, struct hash_page, elem)->va;
+}
+
+/* Returns the next fault address of the sequence seeded by *SEED. */
+static void *
+next_fault (uint64_t *seed)
+{
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint8_t *) page_va[(*seed >> 33) % PAGE_CNT] + (*seed & PGMASK);
+}
+
+static void
+free_hash_page (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct hash_page, elem));
+}
+
+static bool
+count_page (struct page *page UNUSED, void *cnt)
+{
+  (*(size_t *) cnt)++;
+  return true;
+}
+
+void
+test_spt_bench (void)
+{
+  struct supplemental_page_table spt;
+  struct hash table;
+  struct hash_iterator it;
+  uint64_t seed;
+  int64_t start;
+  size_t i, found, walked;
+
+  for (i = 0; i < TEXT_PAGES; i++)
+    page_va[i] = (void *) (0x400000 + i * PGSIZE);
+  for (i = 0; i < HEAP_PAGES; i++)
+    page_va[TEXT_PAGES + i] = (void *) (0x10000000 + i * PGSIZE);
+  for (i = 0; i < STACK_PAGES; i++)
+    page_va[TEXT_PAGES + HEAP_PAGES + i] =
+      (void *) (USER_STACK - (i + 1) * PGSIZE);
+
+  /* Radix tree. */
+  supplemental_page_table_init (&spt);
+  start = timer_ticks ();
+  for (i = 0; i < PAGE_CNT; i++)
+    {
+      struct page *page = malloc (sizeof *page);
+      ASSERT (page != NULL);
+      uninit_new (page, page_va[i], NULL, VM_ANON, NULL, anon_initializer);
+      page->owner = thread_current ();
+      ASSERT (spt_insert_page (&spt, page));
+    }
+  msg ("radix: %d inserts in %lld ticks", PAGE_CNT, timer_elapsed (start));
+
+  seed = 1;
+  found = 0;
+  start = timer_ticks ();
+  for (i = 0; i < LOOKUPS; i++)
+    found += spt_find_page (&spt, next_fault (&seed)) != NULL;
+  msg ("radix: %d lookups in %lld ticks", LOOKUPS, timer_elapsed (start));
+  ASSERT (found == LOOKUPS);
+
+  walked = 0;
+  start = timer_ticks ();
+  for (i = 0; i < 64; i++)
+    spt_for_each (&spt, NULL, (void *) KERN_BASE, count_page, &walked);
+  msg ("radix: 64 ordered walks in %lld ticks", timer_elapsed (start));
+  ASSERT (walked == 64 * PAGE_CNT);
+
+  /* Hash table. */
+  hash_init (&table, hash_page_hash, hash_page_less, NULL);
+  start = timer_ticks ();
+  for (i = 0; i < PAGE_CNT; i++)
+    {
+      struct hash_page *p = malloc (sizeof *p);
+      ASSERT (p != NULL);
+      p->va = page_va[i];
+      hash_insert (&table, &p->elem);
+    }
+  msg ("hash: %d inserts in %lld ticks", PAGE_CNT, timer_elapsed (start));
+
+  seed = 1;
+  found = 0;
+  start = timer_ticks ();
+  for (i = 0; i < LOOKUPS; i++)
+    {
+      struct hash_page key;
+      key.va = pg_round_down (next_fault (&seed));
+      found += hash_find (&table, &key.elem) != NULL;
+    }
+  msg ("hash: %d lookups in %lld ticks", LOOKUPS, timer_elapsed (start));
+  ASSERT (found == LOOKUPS);
+
+  /* Iteration order is arbitrary here; callers that need address
+     order would have to sort on top of this. */
+  walked = 0;
+  start = timer_ticks ();
+  for (i = 0; i < 64; i++)
+    {
+      hash_first (&it, &table);
+      while (hash_next (&it))
+        walked++;
+    }
+  msg ("hash: 64 unordered walks in %lld ticks", timer_elapsed (start));
+  ASSERT (walked == 64 * PAGE_CNT);
+
+  supplemental_page_table_kill (&spt);
+  hash_destroy (&table, free_hash_page);
+  pass ();
+}
+#else
+void
+test_spt_bench (void)
+{
+  msg ("spt-bench needs a kernel built with VM");
+}
+#endif
@@ -0,0 +1,43 @@
+/* Measures fork latency for a process with a large address space.
+
+   The parent dirties 4 MB of data, then forks FORK_CNT children
+   one at a time.  Each child writes a single page, the way a child
+   that is about to exec touches little of what it inherited, and
+   exits.  With copy-on-write, a fork only shares frames and the
+   child copies the one page it writes.
+
+   The kernel prints the ticks spent duplicating address spaces,
+   and how many pages were shared and copied, on its "VM:" lines at
+   power off; compare them with the "Timer:" line for the whole
+   run.  The program checks only each child's exit code.  Run it
+   with "pintos -- -q run fork-bench" in vm/build. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (4 * 1024 * 1024)
+#define FORK_CNT 32
+
+static char buf[SIZE];
+
+void
+test_main (void)
+{
+  size_t i;
+
+  memset (buf, 0x5a, sizeof buf);
+
+  for (i = 0; i < FORK_CNT; i++)
+    {
+      pid_t child = fork ("child");
+      if (child == 0)
+        {
+          buf[i * 4096] = 0;
+          exit (i);
+        }
+      CHECK (wait (child) == (int) i, "fork %zu", i);
+    }
+  CHECK (buf[0] == 0x5a, "parent data intact");
+}
@@ -0,0 +1,135 @@
+/* Fills 4 MB of 2 MB-aligned memory, waits for khugepaged to move
+   it to 2 MB pages, and checks that the data survives that, the
+   split that evicting one page of each 2 MB page forces, a second
+   collapse, and a fork whose child writes its own copy.  The
+   memory is rewritten while the daemon works on it, so writes
+   also race with the copy into the 2 MB frame.  Needs -hp.
+
+   Whether a 2 MB page is in place is told from the physical
+   addresses: all 512 pages contiguous, starting 2 MB-aligned.
+
+   MAX_PASSES bounds the wait in passes, not time, and whether the
+   daemon finds aligned 2 MB frames free depends on how physical
+   memory is laid out, so results vary between machines.  Run it
+   by hand in vm/build with "make tests/vm/page-huge.result". */
+
+#include <stdint.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HUGE_SIZE (2 * 1024 * 1024)
+#define SIZE (2 * HUGE_SIZE)
+#define PAGE_SIZE 4096
+
+/* Passes over the memory to wait for 2 MB pages before giving up.
+   The daemon looks every 100 ms. */
+#define MAX_PASSES 500
+
+static char buf[SIZE] __attribute__ ((aligned (HUGE_SIZE)));
+
+/* Returns byte I of generation GEN of the contents. */
+static char
+value (size_t i, int gen)
+{
+  return (i * 31 + (i >> 12) + gen * 101) & 0xff;
+}
+
+/* Fills the memory with generation GEN of the contents. */
+static void
+fill (int gen)
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    buf[i] = value (i, gen);
+}
+
+/* Fails unless the memory holds generation GEN of the contents. */
+static void
+check (int gen)
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != value (i, gen))
+      fail ("byte %zu is %d, not %d (generation %d)",
+            i, buf[i], value (i, gen), gen);
+}
+
+/* Returns true if each 2 MB half of the memory is a 2 MB page. */
+static bool
+is_huge (void)
+{
+  size_t ofs, i;
+
+  for (ofs = 0; ofs < SIZE; ofs += HUGE_SIZE)
+    {
+      uintptr_t pa = (uintptr_t) get_phys_addr (buf + ofs);
+
+      if (pa == 0 || pa % HUGE_SIZE != 0)
+        return false;
+      for (i = PAGE_SIZE; i < HUGE_SIZE; i += PAGE_SIZE)
+        if ((uintptr_t) get_phys_addr (buf + ofs + i) != pa + i)
+          return false;
+    }
+  return true;
+}
+
+/* Checks and rewrites generation GEN of the contents until the
+   memory is in 2 MB pages. */
+static void
+wait_huge (int gen)
+{
+  int pass;
+
+  for (pass = 0; !is_huge (); pass++)
+    {
+      if (pass >= MAX_PASSES)
+        fail ("no 2 MB pages after %d passes", pass);
+      check (gen);
+      fill (gen);
+    }
+  check (gen);
+}
+
+void
+test_main (void)
+{
+  pid_t child;
+  size_t ofs;
+
+  msg ("fill");
+  fill (0);
+
+  msg ("wait for 2 MB pages");
+  wait_huge (0);
+
+  msg ("write through 2 MB pages");
+  fill (1);
+  check (1);
+
+  msg ("evict a page of each 2 MB page");
+  for (ofs = 0; ofs < SIZE; ofs += HUGE_SIZE)
+    if (madvise (buf + ofs + HUGE_SIZE / 2, PAGE_SIZE, MADV_DONTNEED) != 0)
+      fail ("madvise at offset %zu", ofs);
+  CHECK (!is_huge (), "2 MB pages split");
+  check (1);
+
+  msg ("wait for 2 MB pages again");
+  wait_huge (1);
+
+  msg ("fork");
+  child = fork ("child");
+  if (child == 0)
+    {
+      check (1);
+      msg ("child: write own copy");
+      fill (2);
+      check (2);
+      exit (0);
+    }
+  CHECK (wait (child) == 0, "wait for child");
+  check (1);
+  msg ("parent data intact");
+}
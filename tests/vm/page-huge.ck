@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(page-huge) begin
+(page-huge) fill
+(page-huge) wait for 2 MB pages
+(page-huge) write through 2 MB pages
+(page-huge) evict a page of each 2 MB page
+(page-huge) 2 MB pages split
+(page-huge) wait for 2 MB pages again
+(page-huge) fork
+(page-huge) child: write own copy
+(page-huge) wait for child
+(page-huge) parent data intact
+(page-huge) end
+EOF
+pass;
@@ -31,11 +31,13 @@
 #include "tests/threads/tests.h"
 #ifdef VM
 #include "vm/vm.h"
+#include "vm/zswap.h"
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/page_cache.h"
 #endif
 
 /* Page-map-level-4 with kernel mappings only. */
@@ -49,6 +51,9 @@ static bool format_filesys;
 /* -q: Power off after kernel tasks complete? */
 bool power_off_when_done;
 
+/* -hp: Back 2 MB-aligned user regions with huge pages? */
+bool user_huge_pages;
+
 bool thread_tests;
 
 static void bss_init (void);
@@ -152,15 +157,28 @@ paging_init (uint64_t mem_end) {
 	extern char start, _end_kernel_text;
 	// Maps physical address [0 ~ mem_end] to
 	//   [LOADER_KERN_BASE ~ LOADER_KERN_BASE + mem_end].
-	for (uint64_t pa = 0; pa < mem_end; pa += PGSIZE) {
+	// Whole 2 MB regions go into a single PDE each, only the ones
+	// holding kernel text (which must stay read-only) and the tail
+	// past the last 2 MB boundary are mapped with 4 kB pages.
+	for (uint64_t pa = 0; pa < mem_end; ) {
 		uint64_t va = (uint64_t) ptov(pa);
 
+		if (pa % HUGE_PGSIZE == 0 && pa + HUGE_PGSIZE <= mem_end
+				&& (va + HUGE_PGSIZE <= (uint64_t) &start
+					|| va >= (uint64_t) &_end_kernel_text)) {
+			if ((pte = pml4e_walk_pde (pml4, va, 1)) != NULL)
+				*pte = pa | PTE_P | PTE_W | PTE_PS;
+			pa += HUGE_PGSIZE;
+			continue;
+		}
+
 		perm = PTE_P | PTE_W;
 		if ((uint64_t) &start <= va && va < (uint64_t) &_end_kernel_text)
 			perm &= ~PTE_W;
 
 		if ((pte = pml4e_walk (pml4, va, 1)) != NULL)
 			*pte = pa | perm;
+		pa += PGSIZE;
 	}
 
 	// reload cr3
@@ -216,6 +234,10 @@ parse_options (char **argv) {
 #ifdef FILESYS
 		else if (!strcmp (name, "-f"))
 			format_filesys = true;
+		else if (!strcmp (name, "-pc"))
+			page_cache_pages = atoi (value);
+		else if (!strcmp (name, "-wb"))
+			page_cache_flush_ticks = atoi (value);
 #endif
 		else if (!strcmp (name, "-rs"))
 			random_init (atoi (value));
@@ -224,8 +246,26 @@ parse_options (char **argv) {
 #ifdef USERPROG
 		else if (!strcmp (name, "-ul"))
 			user_page_limit = atoi (value);
+		else if (!strcmp (name, "-hp"))
+			user_huge_pages = true;
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-zs"))
+			zswap_pool_pages = atoi (value);
+		else if (!strcmp (name, "-fa"))
+			fault_around_pages = atoi (value);
+		else if (!strcmp (name, "-wl"))
+			reclaim_low_pages = atoi (value);
+		else if (!strcmp (name, "-wh"))
+			reclaim_high_pages = atoi (value);
+		else if (!strcmp (name, "-ksm"))
+			ksm_pages_per_sec = atoi (value);
+		else if (!strcmp (name, "-ws"))
+			ws_sample_ms = atoi (value);
+		else if (!strcmp (name, "-rss"))
+			rss_soft_limit = atoi (value);
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -326,8 +366,23 @@ usage (void) {
 			"  -f                 Format file system disk during startup.\n"
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
+#ifdef FILESYS
+			"  -pc=PAGES          Cache file data in PAGES pages of memory (32).\n"
+			"  -wb=TICKS          Write cached data back every TICKS ticks (500),\n"
+			"                     or at once if 0.\n"
+#endif
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+			"  -hp                Use 2 MB pages for large user regions.\n"
+#endif
+#ifdef VM
+			"  -zs=PAGES          Keep up to PAGES pages of compressed swap in RAM.\n"
+			"  -fa=PAGES          Load program text PAGES pages at a time (16).\n"
+			"  -wl=PAGES          Start background reclaim below PAGES free frames (32).\n"
+			"  -wh=PAGES          Stop background reclaim at PAGES free frames (64).\n"
+			"  -ksm=PAGES         Merge identical anonymous pages, scanning PAGES/s.\n"
+			"  -ws=MS             Sample process working sets every MS ms.\n"
+			"  -rss=PAGES         Evict first from processes above PAGES resident.\n"
 #endif
 			);
 	power_off ();
@@ -354,7 +409,12 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	palloc_print_stats ();
+#ifdef VM
+	vm_print_stats ();
+#endif
 #ifdef FILESYS
+	page_cache_print_stats ();
 	disk_print_stats ();
 #endif
 	console_print_stats ();
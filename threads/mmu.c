@@ -22,7 +22,9 @@ pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 					return NULL;
 			} else
 				return NULL;
-		}
+		} else if ((uint64_t) pte & PTE_PS)
+			/* 2 MB page: the PDE itself is the leaf entry. */
+			return &pdp[idx];
 		return (uint64_t *) ptov (PTE_ADDR (pdp[idx]) + 8 * PTX (va));
 	}
 	return NULL;
@@ -60,7 +62,9 @@ pdpe_walk (uint64_t *pdpe, const uint64_t va, int create) {
  * If PML4E does not have a page table for VADDR, behavior depends
  * on CREATE.  If CREATE is true, then a new page table is
  * created and a pointer into it is returned.  Otherwise, a null
- * pointer is returned. */
+ * pointer is returned.
+ * If VADDR lies in a 2 MB page, the page directory entry that
+ * maps it is returned instead; see is_huge_pte(). */
 uint64_t *
 pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 	uint64_t *pte = NULL;
@@ -122,10 +126,18 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
-			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
+		if (((uint64_t) pte) & PTE_P) {
+			if (((uint64_t) pte) & PTE_PS) {
+				/* 2 MB page, FUNC gets the PDE. */
+				void *va = (void *) (((uint64_t) pml4_index << PML4SHIFT) |
+									 ((uint64_t) pdp_index << PDPESHIFT) |
+									 ((uint64_t) i << PDXSHIFT));
+				if (!func (&pdp[i], va, aux))
+					return false;
+			} else if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
 					pml4_index, pdp_index, i))
 				return false;
+		}
 	}
 	return true;
 }
@@ -169,8 +181,12 @@ static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
-			pt_destroy (PTE_ADDR (pte));
+		if (((uint64_t) pte) & PTE_P) {
+			if (((uint64_t) pte) & PTE_PS)
+				palloc_free_huge_page (ptov (HUGE_ADDR (pdp[i])));
+			else
+				pt_destroy (PTE_ADDR (pte));
+		}
 	}
 	palloc_free_page ((void *) pdp);
 }
@@ -216,8 +232,12 @@ pml4_get_page (uint64_t *pml4, const void *uaddr) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
-	if (pte && (*pte & PTE_P))
+	if (pte && (*pte & PTE_P)) {
+		if (is_huge_pte (pte))
+			return ptov (HUGE_ADDR (*pte))
+				+ ((uint64_t) uaddr & (HUGE_PGSIZE - 1));
 		return ptov (PTE_ADDR (*pte)) + pg_ofs (uaddr);
+	}
 	return NULL;
 }
 
@@ -238,15 +258,18 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 1);
 
-	if (pte)
+	if (pte) {
+		ASSERT (!is_huge_pte (pte));
 		*pte = vtop (kpage) | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	}
 	return pte != NULL;
 }
 
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
- * UPAGE need not be mapped. */
+ * UPAGE need not be mapped.  If it is part of a 2 MB page, UPAGE
+ * must be the start of it and the whole huge page is cleared. */
 void
 pml4_clear_page (uint64_t *pml4, void *upage) {
 	uint64_t *pte;
@@ -256,6 +279,7 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 	pte = pml4e_walk (pml4, (uint64_t) upage, false);
 
 	if (pte != NULL && (*pte & PTE_P) != 0) {
+		ASSERT (!is_huge_pte (pte) || (uint64_t) upage % HUGE_PGSIZE == 0);
 		*pte &= ~PTE_P;
 		if (rcr3 () == vtop (pml4))
 			invlpg ((uint64_t) upage);
@@ -264,7 +288,8 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 
 /* Returns true if the PTE for virtual page VPAGE in PML4 is dirty,
  * that is, if the page has been modified since the PTE was
- * installed.
+ * installed.  For a page inside a 2 MB page, this is the state of
+ * the whole huge page.
  * Returns false if PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_dirty (uint64_t *pml4, const void *vpage) {
@@ -281,7 +306,7 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
 		if (dirty)
 			*pte |= PTE_D;
 		else
-			*pte &= ~(uint32_t) PTE_D;
+			*pte &= ~(uint64_t) PTE_D;
 
 		if (rcr3 () == vtop (pml4))
 			invlpg ((uint64_t) vpage);
@@ -307,9 +332,328 @@ pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 		if (accessed)
 			*pte |= PTE_A;
 		else
-			*pte &= ~(uint32_t) PTE_A;
+			*pte &= ~(uint64_t) PTE_A;
 
 		if (rcr3 () == vtop (pml4))
 			invlpg ((uint64_t) vpage);
 	}
 }
+
+/* Invalidations gathered while rewriting a range of PTEs.
+ * Once more than TLB_BATCH_MAX pages are touched, a single CR3
+ * reload is cheaper than issuing one invlpg per page.
+ *
+ * Page-table pages unlinked from the tree may still be cached by
+ * the CPU's paging-structure caches, whether or not any of their
+ * entries was present, so they are only freed after a full flush.
+ * Up to TLB_TABLES_MAX of them are held back at a time. */
+#define TLB_BATCH_MAX 16
+#define TLB_TABLES_MAX 16
+
+struct tlb_batch {
+	bool active;                    /* Is the pml4 loaded in CR3? */
+	bool flush_all;                 /* Overflowed, reload CR3 instead. */
+	size_t cnt;                     /* Number of entries in VA. */
+	uint64_t va[TLB_BATCH_MAX];     /* Pages to invalidate. */
+	size_t table_cnt;               /* Number of entries in TABLES. */
+	void *tables[TLB_TABLES_MAX];   /* Tables to free after the flush. */
+};
+
+static void
+tlb_batch_init (struct tlb_batch *batch, uint64_t *pml4) {
+	batch->active = rcr3 () == vtop (pml4);
+	batch->flush_all = false;
+	batch->cnt = 0;
+	batch->table_cnt = 0;
+}
+
+static void
+tlb_batch_add (struct tlb_batch *batch, uint64_t va) {
+	if (!batch->active || batch->flush_all)
+		return;
+	if (batch->cnt == TLB_BATCH_MAX)
+		batch->flush_all = true;
+	else
+		batch->va[batch->cnt++] = va;
+}
+
+static void
+tlb_batch_flush (struct tlb_batch *batch) {
+	if (batch->flush_all)
+		lcr3 (rcr3 ());
+	else
+		for (size_t i = 0; i < batch->cnt; i++)
+			invlpg (batch->va[i]);
+	for (size_t i = 0; i < batch->table_cnt; i++)
+		palloc_free_page (batch->tables[i]);
+	batch->cnt = 0;
+	batch->table_cnt = 0;
+	batch->flush_all = false;
+}
+
+/* Frees TABLE, a page-table page just unlinked from the tree, once
+ * the batch is flushed.  If the pml4 is loaded, that flush has to
+ * reload CR3. */
+static void
+tlb_batch_free_table (struct tlb_batch *batch, void *table) {
+	if (batch->table_cnt == TLB_TABLES_MAX)
+		tlb_batch_flush (batch);
+	batch->tables[batch->table_cnt++] = table;
+	if (batch->active)
+		batch->flush_all = true;
+}
+
+/* Returns true if no entry of the page table TABLE is in use. */
+static bool
+table_is_empty (const uint64_t *table) {
+	for (unsigned i = 0; i < PGSIZE / sizeof (uint64_t); i++)
+		if (table[i] != 0)
+			return false;
+	return true;
+}
+
+/* Returns the first address past VA that is aligned to 1 << SHIFT,
+ * clamped to END. */
+static uint64_t
+next_boundary (uint64_t va, uint64_t shift, uint64_t end) {
+	uint64_t next = (va + (1UL << shift)) & ~((1UL << shift) - 1);
+	return next < end && next > va ? next : end;
+}
+
+/* Action applied to each PTE in a range.  Returns true if the
+ * PTE was changed and the TLB entry for VA has to be dropped. */
+typedef bool range_pte_func (uint64_t *pte, uint64_t va, void *aux);
+
+/* Applies FUNC to every PTE that maps a page in [START, END) of
+ * PML4, skipping unmapped page tables as a whole.  TLB
+ * invalidations are batched and issued once at the end.  If REAP
+ * is true, page-table pages left without any entry are freed, but
+ * only after the flush. */
+static void
+pml4_range_apply (uint64_t *pml4, uint64_t start, uint64_t end,
+		range_pte_func *func, void *aux, bool reap) {
+	struct tlb_batch batch;
+	uint64_t va = start;
+
+	tlb_batch_init (&batch, pml4);
+	while (va < end) {
+		unsigned pml4_idx = PML4 (va);
+		uint64_t *pml4e = &pml4[pml4_idx];
+		uint64_t pml4_end = next_boundary (va, PML4SHIFT, end);
+		if (!(*pml4e & PTE_P)) {
+			va = pml4_end;
+			continue;
+		}
+
+		uint64_t *pdpt = ptov (PTE_ADDR (*pml4e));
+		while (va < pml4_end) {
+			uint64_t *pdpe = &pdpt[PDPE (va)];
+			uint64_t pdpt_end = next_boundary (va, PDPESHIFT, pml4_end);
+			if (!(*pdpe & PTE_P)) {
+				va = pdpt_end;
+				continue;
+			}
+
+			uint64_t *pd = ptov (PTE_ADDR (*pdpe));
+			while (va < pdpt_end) {
+				uint64_t *pde = &pd[PDX (va)];
+				uint64_t pd_end = next_boundary (va, PDXSHIFT, pdpt_end);
+				if (!(*pde & PTE_P)) {
+					va = pd_end;
+					continue;
+				}
+				if (*pde & PTE_PS) {
+					/* A 2 MB page is changed as a whole.  Callers must
+					 * not ask for only part of one. */
+					ASSERT (va % HUGE_PGSIZE == 0 && pd_end - va == HUGE_PGSIZE);
+					if (func (pde, va, aux))
+						tlb_batch_add (&batch, va);
+					va = pd_end;
+					continue;
+				}
+
+				uint64_t *pt = ptov (PTE_ADDR (*pde));
+				for (; va < pd_end; va += PGSIZE) {
+					uint64_t *pte = &pt[PTX (va)];
+					if (*pte != 0 && func (pte, va, aux))
+						tlb_batch_add (&batch, va);
+				}
+				if (reap && table_is_empty (pt)) {
+					*pde = 0;
+					tlb_batch_free_table (&batch, pt);
+				}
+			}
+			if (reap && table_is_empty (pd)) {
+				*pdpe = 0;
+				tlb_batch_free_table (&batch, pd);
+			}
+		}
+		/* Never release a PDPT that is shared with the kernel map. */
+		if (reap && *pml4e != base_pml4[pml4_idx] && table_is_empty (pdpt)) {
+			*pml4e = 0;
+			tlb_batch_free_table (&batch, pdpt);
+		}
+	}
+	tlb_batch_flush (&batch);
+}
+
+static bool
+clear_pte (uint64_t *pte, uint64_t va UNUSED, void *aux UNUSED) {
+	bool present = (*pte & PTE_P) != 0;
+	*pte = 0;
+	return present;
+}
+
+static bool
+protect_pte (uint64_t *pte, uint64_t va UNUSED, void *aux) {
+	bool writable = *(bool *) aux;
+	uint64_t old = *pte;
+
+	if (writable)
+		*pte |= PTE_W;
+	else
+		*pte &= ~(uint64_t) PTE_W;
+	return (old & PTE_P) && old != *pte;
+}
+
+/* Removes every mapping of the user pages in [START, END) from
+ * PML4 and frees the page-table pages that become empty.  The
+ * frames themselves are not freed; that is up to the caller, which
+ * should consult pml4_is_dirty() beforehand if it cares.
+ * TLB invalidation is done in one batch for the whole range and
+ * falls back to a single CR3 reload for large ranges. */
+void
+pml4_clear_range (uint64_t *pml4, void *start, void *end) {
+	ASSERT (pg_ofs (start) == 0);
+	ASSERT (is_user_vaddr (start));
+	ASSERT (end == (void *) KERN_BASE || is_user_vaddr (end));
+	ASSERT (pml4 != base_pml4);
+
+	pml4_range_apply (pml4, (uint64_t) start, (uint64_t) end,
+			clear_pte, NULL, true);
+}
+
+/* Makes every present user page in [START, END) of PML4 writable
+ * if WRITABLE is true, read-only otherwise, with one batched TLB
+ * invalidation for the whole range. */
+void
+pml4_protect_range (uint64_t *pml4, void *start, void *end, bool writable) {
+	ASSERT (pg_ofs (start) == 0);
+	ASSERT (is_user_vaddr (start));
+	ASSERT (end == (void *) KERN_BASE || is_user_vaddr (end));
+
+	pml4_range_apply (pml4, (uint64_t) start, (uint64_t) end,
+			protect_pte, &writable, false);
+}
+
+/* Returns the address of the page directory entry for virtual
+ * address VA in PML4, creating the upper-level tables on the way
+ * if CREATE is true.  Returns a null pointer if they are missing
+ * and CREATE is false, or if memory allocation fails.
+ * The entry either points to a page table or, with PTE_PS set,
+ * maps a 2 MB page by itself. */
+uint64_t *
+pml4e_walk_pde (uint64_t *pml4, const uint64_t va, int create) {
+	uint64_t *table = pml4;
+	const uint64_t index[] = { PML4 (va), PDPE (va) };
+
+	for (int level = 0; level < 2; level++) {
+		uint64_t *entry = &table[index[level]];
+		if (!(*entry & PTE_P)) {
+			uint64_t *new_page;
+			if (!create || (new_page = palloc_get_page (PAL_ZERO)) == NULL)
+				return NULL;
+			*entry = vtop (new_page) | PTE_U | PTE_W | PTE_P;
+		}
+		table = ptov (PTE_ADDR (*entry));
+	}
+	return &table[PDX (va)];
+}
+
+/* Maps the 2 MB user region starting at UPAGE in PML4 to the
+ * physically contiguous frames starting at kernel virtual address
+ * KPAGE, which should come from palloc_get_huge_page().  Both must
+ * be aligned to HUGE_PGSIZE.  The region must not have any 4 kB
+ * page mapped; an empty page table left behind is released.
+ * Returns true if successful, false if the region is in use or
+ * memory allocation failed. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	ASSERT ((uint64_t) upage % HUGE_PGSIZE == 0);
+	ASSERT (vtop (kpage) % HUGE_PGSIZE == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) upage, 1);
+	if (pde == NULL)
+		return false;
+
+	if (*pde & PTE_P) {
+		uint64_t *pt = ptov (PTE_ADDR (*pde));
+		if ((*pde & PTE_PS) || !table_is_empty (pt))
+			return false;
+		palloc_free_page (pt);
+	}
+	*pde = vtop (kpage) | PTE_P | PTE_PS | (rw ? PTE_W : 0) | PTE_U;
+
+	if (rcr3 () == vtop (pml4))
+		invlpg ((uint64_t) upage);
+	return true;
+}
+
+/* Replaces the page table that maps the 2 MB user region at UPAGE
+ * in PML4 with a single 2 MB mapping of KPAGE, and frees the page
+ * table.  Whatever its entries mapped is dropped; the caller is
+ * expected to have copied it to KPAGE.  The new mapping is dirty
+ * if any of the old entries was.  Returns false if the region has
+ * no page table. */
+bool
+pml4_collapse_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	ASSERT ((uint64_t) upage % HUGE_PGSIZE == 0);
+	ASSERT (vtop (kpage) % HUGE_PGSIZE == 0);
+	ASSERT (is_user_vaddr (upage));
+
+	uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) upage, 0);
+	uint64_t dirty = 0;
+	uint64_t *pt;
+
+	if (pde == NULL || !(*pde & PTE_P) || (*pde & PTE_PS))
+		return false;
+	pt = ptov (PTE_ADDR (*pde));
+	for (unsigned i = 0; i < PGSIZE / sizeof (uint64_t); i++)
+		dirty |= pt[i] & PTE_D;
+	*pde = vtop (kpage) | PTE_P | PTE_PS | PTE_A | dirty
+		| (rw ? PTE_W : 0) | PTE_U;
+	palloc_free_page (pt);
+
+	/* The old entries may be cached for any of the 512 pages. */
+	if (rcr3 () == vtop (pml4))
+		lcr3 (rcr3 ());
+	return true;
+}
+
+/* Replaces the 2 MB mapping at UPAGE in PML4 with a page table that
+ * maps the same frames 4 kB at a time, each with the permissions
+ * and the accessed and dirty bits of the 2 MB page.  Returns false
+ * if memory allocation failed. */
+bool
+pml4_split_huge_page (uint64_t *pml4, void *upage) {
+	ASSERT ((uint64_t) upage % HUGE_PGSIZE == 0);
+
+	uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) upage, 0);
+	uint64_t *pt, flags, pa;
+
+	ASSERT (pde != NULL && (*pde & PTE_PS));
+	pt = palloc_get_page (0);
+	if (pt == NULL)
+		return false;
+	flags = *pde & (PTE_P | PTE_W | PTE_U | PTE_A | PTE_D);
+	pa = HUGE_ADDR (*pde);
+	for (unsigned i = 0; i < PGSIZE / sizeof (uint64_t); i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+
+	if (rcr3 () == vtop (pml4))
+		invlpg ((uint64_t) upage);
+	return true;
+}
@@ -8,9 +8,15 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
+#include "threads/pte.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 /* Page allocator.  Hands out memory in page-size (or
    page-multiple) chunks.  See malloc.h for an allocator that
@@ -24,13 +30,60 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   The split is only the starting point.  A pool that runs out of
+   pages borrows a chunk of LOAN_PAGES free pages from the other
+   one and serves its allocations from there until every page of
+   the chunk has been freed again, at which point the chunk goes
+   back to its owner.  A pool only lends while it keeps a quarter
+   of its own pages free, and the user side never grows past the
+   -ul limit.
+
+   While nothing else is runnable, the idle thread zeroes free
+   pages ahead of time (see palloc_zero_idle()) and marks them in
+   the pool's zeroed_map.  PAL_ZERO requests take those pages
+   first and skip the memset.  Any other allocation that lands on
+   a pre-zeroed page just clears its bit. */
+
+/* Pages are lent between pools in chunks of this many pages. */
+#define LOAN_PAGES 64
+
+/* Maximum number of chunks a pool can borrow at once. */
+#define LOAN_MAX 64
+
+/* At most 1/PREZERO_RATIO of a pool's pages are kept pre-zeroed. */
+#define PREZERO_RATIO 8
+
+/* Pages the idle thread looks at per call for one to zero. */
+#define PREZERO_SCAN 64
+
+/* A chunk of pages borrowed from the other pool. */
+struct loan {
+	uint8_t *base;                  /* First page, null if slot is free. */
+	uint64_t used;                  /* Bit N set if page N is in use. */
+};
 
 /* A memory pool. */
 struct pool {
 	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
+	struct bitmap *zeroed_map;      /* Free pages known to be zeroed. */
 	uint8_t *base;                  /* Base of pool. */
+
+	size_t usable_cnt;              /* Pages of our own that can be used. */
+	size_t free_cnt;                /* Pages free in USED_MAP. */
+	size_t used_cnt;                /* Pages handed out, borrowed included. */
+	size_t peak_cnt;                /* High-water mark of USED_CNT. */
+	size_t lent_cnt;                /* Pages lent to the other pool. */
+	size_t borrowed_cnt;            /* Pages borrowed from the other pool. */
+	struct loan loans[LOAN_MAX];    /* Chunks borrowed from the other pool. */
+
+	size_t zeroed_cnt;              /* Pages set in ZEROED_MAP. */
+	size_t zero_hits;               /* PAL_ZERO pages found pre-zeroed. */
+	size_t zero_misses;             /* PAL_ZERO pages zeroed on demand. */
+	size_t pending_idx;             /* Zeroed page to fold in, or BITMAP_ERROR. */
+	size_t zero_cursor;             /* Where the idle thread looks next. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -38,10 +91,26 @@ static struct pool kernel_pool, user_pool;
 
 /* Maximum number of pages to put in user pool. */
 size_t user_page_limit = SIZE_MAX;
+
+#ifdef VM
+/* Frame descriptors of all of physical memory, indexed by frame
+   number.  Carved out of boot memory next to the pool bitmaps. */
+struct frame *mem_map;
+size_t mem_map_cnt;
+
+static void init_mem_map (void **base, uint64_t mem_end);
+#endif
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
 static bool page_from_pool (const struct pool *, void *page);
+static void pool_fold_pending (struct pool *);
+static void pool_take (struct pool *, size_t page_idx, size_t page_cnt);
+static void *pool_alloc (struct pool *, size_t page_cnt, bool zero,
+		bool *zeroed);
+static uint8_t *pool_borrow (struct pool *);
+static void pool_unborrow (struct pool *, uint8_t *chunk);
+static bool pool_free_borrowed (struct pool *, void *pages, size_t page_cnt);
 
 /* multiboot info */
 struct multiboot_info {
@@ -189,6 +258,9 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 
 	// generate the user pool
 	init_pool(&user_pool, &free_start, region_start, end);
+#ifdef VM
+	init_mem_map (&free_start, ext_mem->end);
+#endif
 
 	// Iterate over the e820_entry. Setup the usable.
 	uint64_t usable_bound = (uint64_t) free_start;
@@ -250,6 +322,13 @@ palloc_init (void) {
 	printf ("\text_mem: 0x%llx ~ 0x%llx (Usable: %'llu kB)\n",
 		  ext_mem.start, ext_mem.end, ext_mem.size / 1024);
 	populate_pools (&base_mem, &ext_mem);
+
+	kernel_pool.usable_cnt = kernel_pool.free_cnt =
+		bitmap_count (kernel_pool.used_map, 0,
+				bitmap_size (kernel_pool.used_map), false);
+	user_pool.usable_cnt = user_pool.free_cnt =
+		bitmap_count (user_pool.used_map, 0,
+				bitmap_size (user_pool.used_map), false);
 	return ext_mem.end;
 }
 
@@ -262,19 +341,31 @@ palloc_init (void) {
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	bool zero = (flags & PAL_ZERO) != 0;
+	bool zeroed = false;
+	uint8_t *chunk;
+	void *pages;
 
 	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+	pages = pool_alloc (pool, page_cnt, zero, &zeroed);
 	lock_release (&pool->lock);
-	void *pages;
 
-	if (page_idx != BITMAP_ERROR)
-		pages = pool->base + PGSIZE * page_idx;
-	else
-		pages = NULL;
+	/* Out of pages: borrow from the other pool and try again.  Only
+	   requests that fit in one chunk can be served from a loan, and
+	   a chunk that did not help after all goes straight back. */
+	while (pages == NULL && page_cnt <= LOAN_PAGES
+			&& (chunk = pool_borrow (pool)) != NULL) {
+		lock_acquire (&pool->lock);
+		pages = pool_alloc (pool, page_cnt, zero, &zeroed);
+		lock_release (&pool->lock);
+		if (pages == NULL) {
+			pool_unborrow (pool, chunk);
+			break;
+		}
+	}
 
 	if (pages) {
-		if (flags & PAL_ZERO)
+		if (zero && !zeroed)
 			memset (pages, 0, PGSIZE * page_cnt);
 	} else {
 		if (flags & PAL_ASSERT)
@@ -296,6 +387,52 @@ palloc_get_page (enum palloc_flags flags) {
 	return palloc_get_multiple (flags, 1);
 }
 
+/* Obtains HUGE_PGCNT contiguous free pages whose physical address
+   is aligned to HUGE_PGSIZE, so that they can back one 2 MB
+   mapping.  FLAGS are interpreted as by palloc_get_multiple().
+   Returns a null pointer if no such run is free.  Huge pages are
+   never borrowed from the other pool. */
+void *
+palloc_get_huge_page (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t base_no = pg_no (pool->base);
+	size_t pool_cnt = bitmap_size (pool->used_map);
+	size_t page_idx;
+	void *pages = NULL;
+
+	/* Kernel virtual addresses are an offset of physical ones by an
+	   aligned KERN_BASE, so aligning one aligns the other. */
+	lock_acquire (&pool->lock);
+	pool_fold_pending (pool);
+	for (page_idx = ROUND_UP (base_no, HUGE_PGCNT) - base_no;
+			page_idx + HUGE_PGCNT <= pool_cnt; page_idx += HUGE_PGCNT)
+		if (bitmap_none (pool->used_map, page_idx, HUGE_PGCNT)) {
+			pool_take (pool, page_idx, HUGE_PGCNT);
+			pool->used_cnt += HUGE_PGCNT;
+			if (pool->used_cnt > pool->peak_cnt)
+				pool->peak_cnt = pool->used_cnt;
+			pages = pool->base + PGSIZE * page_idx;
+			break;
+		}
+	lock_release (&pool->lock);
+
+	if (pages) {
+		if (flags & PAL_ZERO)
+			memset (pages, 0, HUGE_PGSIZE);
+	} else {
+		if (flags & PAL_ASSERT)
+			PANIC ("palloc_get_huge_page: out of pages");
+	}
+	return pages;
+}
+
+/* Frees the huge page at PAGES. */
+void
+palloc_free_huge_page (void *pages) {
+	ASSERT (vtop (pages) % HUGE_PGSIZE == 0);
+	palloc_free_multiple (pages, HUGE_PGCNT);
+}
+
 /* Frees the PAGE_CNT pages starting at PAGES. */
 void
 palloc_free_multiple (void *pages, size_t page_cnt) {
@@ -313,13 +450,23 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 	else
 		NOT_REACHED ();
 
-	page_idx = pg_no (pages) - pg_no (pool->base);
-
 #ifndef NDEBUG
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
+
+	/* Pages of a chunk we lent out belong to the borrower. */
+	if (pool->lent_cnt > 0
+			&& pool_free_borrowed (pool == &kernel_pool ? &user_pool : &kernel_pool,
+				pages, page_cnt))
+		return;
+
+	page_idx = pg_no (pages) - pg_no (pool->base);
+	lock_acquire (&pool->lock);
 	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
 	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	pool->free_cnt += page_cnt;
+	pool->used_cnt -= page_cnt;
+	lock_release (&pool->lock);
 }
 
 /* Frees the page at PAGE. */
@@ -328,6 +475,316 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of pages that can still be allocated from
+   the pool FLAGS selects without borrowing more, counting free
+   pages in the chunks it has borrowed already. */
+size_t
+palloc_free_cnt (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t cnt;
+
+	lock_acquire (&pool->lock);
+	cnt = pool->usable_cnt + pool->borrowed_cnt - pool->lent_cnt
+		- pool->used_cnt;
+	lock_release (&pool->lock);
+	return cnt;
+}
+
+/* Prints the usage of each pool, including its high-water mark. */
+void
+palloc_print_stats (void) {
+	const struct pool *pools[] = { &kernel_pool, &user_pool };
+	const char *names[] = { "kernel", "user" };
+
+	for (int i = 0; i < 2; i++)
+		printf ("Palloc: %s pool: %zu of %zu pages in use, peak %zu, "
+				"%zu borrowed, %zu lent\n", names[i], pools[i]->used_cnt,
+				pools[i]->usable_cnt, pools[i]->peak_cnt,
+				pools[i]->borrowed_cnt, pools[i]->lent_cnt);
+	for (int i = 0; i < 2; i++)
+		printf ("Palloc: %s pool: %zu pages pre-zeroed, "
+				"%zu of %zu zeroed pages served without memset\n", names[i],
+				pools[i]->zeroed_cnt, pools[i]->zero_hits,
+				pools[i]->zero_hits + pools[i]->zero_misses);
+}
+
+/* Zeroes one free page while the CPU would otherwise be idle, so
+   that a later PAL_ZERO request can skip it.  The user pool is
+   served first.  Returns false if there was nothing to do, in
+   which case the caller should stop asking for now.
+
+   Called only from the idle thread, which must never block and is
+   never on the ready list, so it must not hold a pool lock where a
+   timer interrupt could preempt it.  Instead it works on a pool
+   only with interrupts off while nobody holds its lock, and holds
+   the page as in use while it zeroes it with interrupts on.  If the
+   lock is busy by the time the page is done, the page is parked in
+   the pool's pending slot for the next allocator to fold in. */
+bool
+palloc_zero_idle (void) {
+	struct pool *pools[] = { &user_pool, &kernel_pool };
+
+	for (int i = 0; i < 2; i++) {
+		struct pool *pool = pools[i];
+		enum intr_level old_level;
+		size_t page_idx;
+		void *page;
+
+		old_level = intr_disable ();
+		if (lock_is_held (&pool->lock)) {
+			intr_set_level (old_level);
+			continue;
+		}
+		pool_fold_pending (pool);
+		if (pool->zeroed_cnt >= pool->usable_cnt / PREZERO_RATIO
+				|| pool->free_cnt <= pool->zeroed_cnt) {
+			intr_set_level (old_level);
+			continue;
+		}
+
+		/* Any free page that is not zeroed yet will do.  Only a
+		   window of PREZERO_SCAN pages is looked at per call, so
+		   interrupts stay off for a bounded time; the next call
+		   goes on where this one stopped. */
+		page_idx = BITMAP_ERROR;
+		for (size_t n = 0; n < PREZERO_SCAN; n++) {
+			size_t idx = pool->zero_cursor;
+
+			if (++pool->zero_cursor >= bitmap_size (pool->used_map))
+				pool->zero_cursor = 0;
+			if (!bitmap_test (pool->used_map, idx)
+					&& !bitmap_test (pool->zeroed_map, idx)) {
+				page_idx = idx;
+				break;
+			}
+		}
+		if (page_idx == BITMAP_ERROR) {
+			intr_set_level (old_level);
+			return true;
+		}
+		pool_take (pool, page_idx, 1);
+		intr_set_level (old_level);
+
+		page = pool->base + PGSIZE * page_idx;
+		memset (page, 0, PGSIZE);
+
+		old_level = intr_disable ();
+		pool->pending_idx = page_idx;
+		if (!lock_is_held (&pool->lock))
+			pool_fold_pending (pool);
+		intr_set_level (old_level);
+		return true;
+	}
+	return false;
+}
+
+/* Marks the page the idle thread left in POOL's pending slot, if
+   any, as free and zeroed.  POOL's lock must be held, or interrupts
+   must be off with the lock free.  Only the idle thread fills the
+   slot, and only while it is empty, so clearing it first is safe. */
+static void
+pool_fold_pending (struct pool *pool) {
+	size_t page_idx = pool->pending_idx;
+
+	if (page_idx == BITMAP_ERROR)
+		return;
+	pool->pending_idx = BITMAP_ERROR;
+	bitmap_reset (pool->used_map, page_idx);
+	bitmap_mark (pool->zeroed_map, page_idx);
+	pool->free_cnt++;
+	pool->zeroed_cnt++;
+}
+
+/* Marks the PAGE_CNT free pages of POOL starting at PAGE_IDX as
+   in use, dropping whatever pre-zeroed state they had.  POOL's
+   lock must be held. */
+static void
+pool_take (struct pool *pool, size_t page_idx, size_t page_cnt) {
+	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, true);
+	pool->free_cnt -= page_cnt;
+	if (pool->zeroed_cnt > 0) {
+		size_t zeroed = bitmap_count (pool->zeroed_map, page_idx, page_cnt, true);
+		if (zeroed > 0) {
+			bitmap_set_multiple (pool->zeroed_map, page_idx, page_cnt, false);
+			pool->zeroed_cnt -= zeroed;
+		}
+	}
+}
+
+/* Returns the mask of PAGE_CNT pages starting at page START of a
+   borrowed chunk. */
+static uint64_t
+loan_mask (size_t start, size_t page_cnt) {
+	uint64_t bits = page_cnt == LOAN_PAGES ? ~0ULL : (1ULL << page_cnt) - 1;
+	return bits << start;
+}
+
+/* Allocates PAGE_CNT contiguous pages for POOL, first from its own
+   pages and then from the chunks it has borrowed.  Returns a null
+   pointer if neither has room.  If ZERO is true, pre-zeroed pages
+   are preferred and *ZEROED tells whether they were found.  POOL's
+   lock must be held. */
+static void *
+pool_alloc (struct pool *pool, size_t page_cnt, bool zero, bool *zeroed) {
+	uint8_t *pages = NULL;
+	size_t page_idx = BITMAP_ERROR;
+
+	ASSERT (lock_held_by_current_thread (&pool->lock));
+
+	pool_fold_pending (pool);
+	*zeroed = false;
+	if (zero) {
+		if (pool->zeroed_cnt >= page_cnt)
+			page_idx = bitmap_scan (pool->zeroed_map, 0, page_cnt, true);
+		if (page_idx != BITMAP_ERROR) {
+			*zeroed = true;
+			pool->zero_hits += page_cnt;
+		} else
+			pool->zero_misses += page_cnt;
+	}
+	if (page_idx == BITMAP_ERROR)
+		page_idx = bitmap_scan (pool->used_map, 0, page_cnt, false);
+
+	if (page_idx != BITMAP_ERROR) {
+		pages = pool->base + PGSIZE * page_idx;
+		pool_take (pool, page_idx, page_cnt);
+	} else if (page_cnt <= LOAN_PAGES && pool->borrowed_cnt > 0) {
+		struct loan *l;
+		for (l = pool->loans; pages == NULL && l < pool->loans + LOAN_MAX; l++) {
+			if (l->base == NULL)
+				continue;
+			for (size_t i = 0; i + page_cnt <= LOAN_PAGES; i++)
+				if ((l->used & loan_mask (i, page_cnt)) == 0) {
+					l->used |= loan_mask (i, page_cnt);
+					pages = l->base + PGSIZE * i;
+					break;
+				}
+		}
+	}
+
+	if (pages != NULL) {
+		pool->used_cnt += page_cnt;
+		if (pool->used_cnt > pool->peak_cnt)
+			pool->peak_cnt = pool->used_cnt;
+	}
+	return pages;
+}
+
+/* Gives the borrowed chunk at CHUNK back to LENDER. */
+static void
+pool_return_chunk (struct pool *lender, uint8_t *chunk) {
+	size_t page_idx = pg_no (chunk) - pg_no (lender->base);
+
+	lock_acquire (&lender->lock);
+	bitmap_set_multiple (lender->used_map, page_idx, LOAN_PAGES, false);
+	lender->free_cnt += LOAN_PAGES;
+	lender->lent_cnt -= LOAN_PAGES;
+	lock_release (&lender->lock);
+}
+
+/* Borrows a chunk of LOAN_PAGES free pages from the other pool
+   for POOL and returns it.  Returns a null pointer if the lender
+   cannot spare one or POOL cannot take more.  Must be called
+   without either lock held. */
+static uint8_t *
+pool_borrow (struct pool *pool) {
+	struct pool *lender = pool == &kernel_pool ? &user_pool : &kernel_pool;
+	uint8_t *chunk = NULL;
+	struct loan *l;
+
+	if (pool == &user_pool && user_page_limit != SIZE_MAX
+			&& pool->usable_cnt + pool->borrowed_cnt + LOAN_PAGES > user_page_limit)
+		return NULL;
+
+	lock_acquire (&lender->lock);
+	if (lender->free_cnt >= LOAN_PAGES + lender->usable_cnt / 4) {
+		size_t page_idx =
+			bitmap_scan (lender->used_map, 0, LOAN_PAGES, false);
+		if (page_idx != BITMAP_ERROR) {
+			chunk = lender->base + PGSIZE * page_idx;
+			pool_take (lender, page_idx, LOAN_PAGES);
+			lender->lent_cnt += LOAN_PAGES;
+		}
+	}
+	lock_release (&lender->lock);
+	if (chunk == NULL)
+		return NULL;
+
+	lock_acquire (&pool->lock);
+	for (l = pool->loans; l < pool->loans + LOAN_MAX; l++)
+		if (l->base == NULL) {
+			l->base = chunk;
+			l->used = 0;
+			pool->borrowed_cnt += LOAN_PAGES;
+			break;
+		}
+	lock_release (&pool->lock);
+
+	if (l == pool->loans + LOAN_MAX) {
+		/* Every loan slot is taken. */
+		pool_return_chunk (lender, chunk);
+		return NULL;
+	}
+	return chunk;
+}
+
+/* Gives CHUNK, which POOL has just borrowed, back to its lender
+   if none of its pages has been handed out meanwhile.  Otherwise
+   it goes back once they are freed, as usual. */
+static void
+pool_unborrow (struct pool *pool, uint8_t *chunk) {
+	bool unused = false;
+
+	lock_acquire (&pool->lock);
+	for (struct loan *l = pool->loans; l < pool->loans + LOAN_MAX; l++)
+		if (l->base == chunk) {
+			if (l->used == 0) {
+				l->base = NULL;
+				pool->borrowed_cnt -= LOAN_PAGES;
+				unused = true;
+			}
+			break;
+		}
+	lock_release (&pool->lock);
+
+	if (unused)
+		pool_return_chunk (pool == &kernel_pool ? &user_pool : &kernel_pool,
+				chunk);
+}
+
+/* If the PAGE_CNT pages at PAGES belong to a chunk BORROWER has
+   borrowed, frees them there and returns true.  A chunk left with
+   no page in use is given back to its lender right away. */
+static bool
+pool_free_borrowed (struct pool *borrower, void *pages, size_t page_cnt) {
+	uint8_t *chunk = NULL;
+	bool found = false;
+
+	lock_acquire (&borrower->lock);
+	for (struct loan *l = borrower->loans; l < borrower->loans + LOAN_MAX; l++)
+		if (l->base != NULL && (uint8_t *) pages >= l->base
+				&& (uint8_t *) pages < l->base + LOAN_PAGES * PGSIZE) {
+			uint64_t mask = loan_mask (pg_no (pages) - pg_no (l->base), page_cnt);
+
+			ASSERT ((l->used & mask) == mask);
+			l->used &= ~mask;
+			borrower->used_cnt -= page_cnt;
+			if (l->used == 0) {
+				chunk = l->base;
+				l->base = NULL;
+				borrower->borrowed_cnt -= LOAN_PAGES;
+			}
+			found = true;
+			break;
+		}
+	lock_release (&borrower->lock);
+
+	if (chunk != NULL)
+		pool_return_chunk (borrower == &kernel_pool ? &user_pool : &kernel_pool,
+				chunk);
+	return found;
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
@@ -339,14 +796,35 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
 
 	lock_init(&p->lock);
 	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
+	p->zeroed_map = bitmap_create_in_buf (pgcnt, *bm_base + bm_pages, bm_pages);
 	p->base = (void *) start;
+	p->pending_idx = BITMAP_ERROR;
+	p->zero_cursor = 0;
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
 
-	*bm_base += bm_pages;
+	*bm_base += 2 * bm_pages;
 }
 
+#ifdef VM
+/* Places one frame descriptor per physical page below MEM_END at
+   *BASE and advances *BASE past them. */
+static void
+init_mem_map (void **base, uint64_t mem_end) {
+	size_t bytes;
+
+	mem_map_cnt = mem_end / PGSIZE;
+	bytes = ROUND_UP (mem_map_cnt * sizeof *mem_map, PGSIZE);
+	mem_map = *base;
+	memset (mem_map, 0, bytes);
+	for (size_t pfn = 0; pfn < mem_map_cnt; pfn++)
+		mem_map[pfn].kva = ptov ((uint64_t) pfn * PGSIZE);
+
+	*base += bytes;
+}
+#endif
+
 /* Returns true if PAGE was allocated from POOL,
    false otherwise. */
 static bool
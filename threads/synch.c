@@ -277,6 +277,18 @@ lock_held_by_current_thread (const struct lock *lock) {
 
 	return lock->holder == thread_current ();
 }
+
+/* Returns true if some thread holds LOCK, false otherwise.
+   Interrupts must be off, so that the answer still holds when it
+   is used.  The semaphore is tested rather than the holder, which
+   lock_acquire() sets only after downing it. */
+bool
+lock_is_held (const struct lock *lock) {
+	ASSERT (lock != NULL);
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	return lock->semaphore.value == 0;
+}
 
 
 
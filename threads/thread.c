@@ -480,6 +480,16 @@ idle (void *idle_started_ UNUSED) {
 		intr_disable ();
 		thread_block ();
 
+		/* Nothing else wants the CPU: zero free pages for later
+		   PAL_ZERO requests, one at a time, until some thread
+		   becomes runnable or there is nothing left to zero. */
+		intr_enable ();
+		while (list_empty (&ready_list) && palloc_zero_idle ())
+			continue;
+		intr_disable ();
+		if (!list_empty (&ready_list))
+			continue;
+
 		/* Re-enable interrupts and wait for the next one.
 
 		   The `sti' instruction disables interrupts until the
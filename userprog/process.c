@@ -18,6 +18,7 @@
 #include "threads/mmu.h"
 #include "threads/vaddr.h"
 #include "intrinsic.h"
+#include "threads/malloc.h"
 #ifdef VM
 #include "vm/vm.h"
 #endif
@@ -145,6 +146,18 @@ duplicate_pte (uint64_t *pte, void *va, void *aux) {
 	if (parent_page == NULL){
 		return false;
 	}
+	/* 2 MB page: copy it as a whole. */
+	if (is_huge_pte (pte)) {
+		newpage = palloc_get_huge_page (PAL_USER);
+		if (newpage == NULL)
+			return false;
+		memcpy (newpage, parent_page, HUGE_PGSIZE);
+		if (!pml4_set_huge_page (current->pml4, va, newpage, is_writable (pte))) {
+			palloc_free_huge_page (newpage);
+			return false;
+		}
+		return true;
+	}
 	/* 3. TODO: Allocate new PAL_USER page for the child and set result to
 	 *    TODO: NEW.PAGE. */
 	newpage = palloc_get_page(PAL_USER | PAL_ZERO);
@@ -404,6 +417,9 @@ void process_exit(void)
         close(i);
     palloc_free_page(curr->fd_table);
     file_close(curr->running); // 2) 현재 실행 중인 파일도 닫는다.
+#ifdef VM
+    vm_print_rss (curr);
+#endif
     process_cleanup();
     // 3) 자식이 종료될 때까지 대기하고 있는 부모에게 signal을 보낸다.
     sema_up(&curr->wait_sema);
@@ -678,6 +694,8 @@ validate_segment (const struct Phdr *phdr, struct file *file) {
 
 /* load() helpers. */
 static bool install_page (void *upage, void *kpage, bool writable);
+static bool load_huge_page (struct file *file, uint8_t *upage,
+		size_t page_read_bytes, bool writable);
 
 /* Loads a segment starting at offset OFS in FILE at address
  * UPAGE.  In total, READ_BYTES + ZERO_BYTES bytes of virtual
@@ -702,6 +720,20 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 
 	file_seek (file, ofs);
 	while (read_bytes > 0 || zero_bytes > 0) {
+		/* With -hp, fill whole aligned 2 MB chunks with a single huge
+		 * page.  If none is available, fall back to 4 kB pages. */
+		if (user_huge_pages && (uint64_t) upage % HUGE_PGSIZE == 0
+				&& read_bytes + zero_bytes >= HUGE_PGSIZE) {
+			size_t huge_read_bytes =
+				read_bytes < HUGE_PGSIZE ? read_bytes : HUGE_PGSIZE;
+			if (load_huge_page (file, upage, huge_read_bytes, writable)) {
+				read_bytes -= huge_read_bytes;
+				zero_bytes -= HUGE_PGSIZE - huge_read_bytes;
+				upage += HUGE_PGSIZE;
+				continue;
+			}
+		}
+
 		/* Do calculate how to fill this page.
 		 * We will read PAGE_READ_BYTES bytes from FILE
 		 * and zero the final PAGE_ZERO_BYTES bytes. */
@@ -735,6 +767,29 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 	return true;
 }
 
+/* Loads one 2 MB huge page at UPAGE, reading PAGE_READ_BYTES from
+ * FILE's current position and zeroing the rest.  Returns false,
+ * leaving FILE's position untouched, if no huge page is free or
+ * it cannot be mapped; the caller then uses 4 kB pages. */
+static bool
+load_huge_page (struct file *file, uint8_t *upage, size_t page_read_bytes,
+		bool writable) {
+	struct thread *t = thread_current ();
+	off_t pos = file_tell (file);
+	uint8_t *kpage = palloc_get_huge_page (PAL_USER);
+
+	if (kpage == NULL)
+		return false;
+	if (file_read (file, kpage, page_read_bytes) != (int) page_read_bytes
+			|| !pml4_set_huge_page (t->pml4, upage, kpage, writable)) {
+		file_seek (file, pos);
+		palloc_free_huge_page (kpage);
+		return false;
+	}
+	memset (kpage + page_read_bytes, 0, HUGE_PGSIZE - page_read_bytes);
+	return true;
+}
+
 /* Create a minimal stack by mapping a zeroed page at the USER_STACK */
 static bool
 setup_stack (struct intr_frame *if_) {
@@ -775,11 +830,21 @@ install_page (void *upage, void *kpage, bool writable) {
  * If you want to implement the function for only project 2, implement it on the
  * upper block. */
 
+/* Reads the part of a segment described by AUX, a struct
+ * file_page, into PAGE on its first fault and zeroes the rest. */
 static bool
 lazy_load_segment (struct page *page, void *aux) {
-	/* TODO: Load the segment from the file */
-	/* TODO: This called when the first page fault occurs on address VA. */
-	/* TODO: VA is available when calling this function. */
+	struct file_page *seg = aux;
+	uint8_t *kva = page->frame->kva;
+	bool locked = vm_lock_filesys ();
+	bool success = file_read_at (seg->file, kva, seg->read_bytes, seg->ofs)
+		== (off_t) seg->read_bytes;
+
+	vm_unlock_filesys (locked);
+	memset (kva + seg->read_bytes, 0, PGSIZE - seg->read_bytes);
+	file_close (seg->file);
+	free (seg);
+	return success;
 }
 
 /* Loads a segment starting at offset OFS in FILE at address
@@ -810,16 +875,36 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
-		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		void *aux = NULL;
-		if (!vm_alloc_page_with_initializer (VM_ANON, upage,
-					writable, lazy_load_segment, aux))
+		/* Pages with nothing to read are simply zero-filled. */
+		struct file_page *aux = NULL;
+		if (page_read_bytes > 0) {
+			aux = malloc (sizeof *aux);
+			if (aux == NULL)
+				return false;
+			*aux = (struct file_page) {
+				.file = file_reopen (file),
+				.ofs = ofs,
+				.read_bytes = page_read_bytes,
+			};
+			if (aux->file == NULL) {
+				free (aux);
+				return false;
+			}
+		}
+		if (!vm_alloc_page_with_initializer (VM_ANON, upage, writable,
+					aux != NULL ? lazy_load_segment : NULL, aux)) {
+			if (aux != NULL) {
+				file_close (aux->file);
+				free (aux);
+			}
 			return false;
+		}
 
 		/* Advance. */
 		read_bytes -= page_read_bytes;
 		zero_bytes -= page_zero_bytes;
 		upage += PGSIZE;
+		ofs += page_read_bytes;
 	}
 	return true;
 }
@@ -830,11 +915,12 @@ setup_stack (struct intr_frame *if_) {
 	bool success = false;
 	void *stack_bottom = (void *) (((uint8_t *) USER_STACK) - PGSIZE);
 
-	/* TODO: Map the stack on stack_bottom and claim the page immediately.
-	 * TODO: If success, set the rsp accordingly.
-	 * TODO: You should mark the page is stack. */
-	/* TODO: Your code goes here */
-
+	/* VM_MARKER_0 marks stack pages. */
+	if (vm_alloc_page (VM_ANON | VM_MARKER_0, stack_bottom, true)
+			&& vm_claim_page (stack_bottom)) {
+		if_->rsp = USER_STACK;
+		success = true;
+	}
 	return success;
 }
 #endif /* VM */
@@ -11,6 +11,10 @@
 #include "userprog/process.h"
 #include "filesys/file.h"
 #include "threads/palloc.h"
+#include "threads/vaddr.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 struct lock filesys_lock;
 void syscall_entry (void);
@@ -32,6 +36,11 @@ int write (int fd, void *buffer, unsigned size);
 void seek(int fd, unsigned position);
 unsigned tell(int fd);
 void close(int fd);
+#ifdef VM
+void *mmap (void *addr, size_t length, int writable, int fd, off_t offset);
+void munmap (void *addr);
+int madvise (void *addr, size_t length, int advice);
+#endif
 
 void process_close_file(int fd);
 struct file *process_get_file(int fd);
@@ -71,6 +80,10 @@ syscall_handler (struct intr_frame *f UNUSED) {
 	// TODO: Your implementation goes here.
 	
 	int sys_number = f->R.rax;
+#ifdef VM
+	/* Page faults inside the call need this for stack growth. */
+	thread_current ()->user_rsp = f->rsp;
+#endif
 	switch (sys_number){
 
 		case SYS_HALT:			/* Halt the operating system. */
@@ -130,6 +143,21 @@ syscall_handler (struct intr_frame *f UNUSED) {
 			 close(f->R.rdi);
 			 break;
 
+#ifdef VM
+		case SYS_MMAP:			/* Map a file into memory. */
+			 f->R.rax = (uint64_t) mmap ((void *) f->R.rdi, f->R.rsi, f->R.rdx,
+					 f->R.r10, f->R.r8);
+			 break;
+
+		case SYS_MUNMAP:		/* Remove a memory mapping. */
+			 munmap ((void *) f->R.rdi);
+			 break;
+
+		case SYS_MADVISE:		/* Advise on the use of a memory range. */
+			 f->R.rax = madvise ((void *) f->R.rdi, f->R.rsi, f->R.rdx);
+			 break;
+#endif
+
 		default:
 			// printf ("system call!\n");
 			// thread_exit ();
@@ -234,6 +262,11 @@ int read (int fd, void *buffer, unsigned size)
  {
 	check_address(buffer);
 	check_address(buffer+size-1);
+#ifdef VM
+	/* Fault the buffer in before taking the file system lock. */
+	if (!vm_pin_buffer (buffer, size, true))
+		exit (-1);
+#endif
 	struct thread *curr = thread_current();
 	struct file *file = process_get_file(fd);
 	unsigned char *buf = buffer;
@@ -250,12 +283,15 @@ int read (int fd, void *buffer, unsigned size)
 			}
 		}
 	} else if(file == STDOUT){
-		return -1;
+		file_bytes = -1;
 	} else{
 		lock_acquire(&filesys_lock);
 		file_bytes = file_read(file,buffer,size);
 		lock_release(&filesys_lock);
 	}
+#ifdef VM
+	vm_unpin_buffer (buffer, size);
+#endif
 	return file_bytes;
 
  /* 파일에 동시 접근이 일어날 수 있으므로 Lock 사용 */
@@ -284,6 +320,10 @@ int write(int fd, void *buffer, unsigned size)
 
 	if (file_obj == NULL)
 		return -1;
+#ifdef VM
+	if (!vm_pin_buffer (buffer, size, false))
+		exit (-1);
+#endif
 	
 	/* STDOUT일 때 */
 	if(file_obj == STDOUT)
@@ -295,8 +335,7 @@ int write(int fd, void *buffer, unsigned size)
 	/* STDIN일 때 : -1 반환 */
 	else if (file_obj == STDIN)
 	{
-		
-		return -1;
+		read_count = -1;
 	}
 	
 	else {
@@ -304,6 +343,9 @@ int write(int fd, void *buffer, unsigned size)
 			read_count = file_write(file_obj,buffer, size);
 			lock_release(&filesys_lock);
 	}
+#ifdef VM
+	vm_unpin_buffer (buffer, size);
+#endif
 	return read_count;
 
 }
@@ -390,3 +432,49 @@ process_close_file(int fd){
 	}
 	curr->fd_table[fd] = NULL;
 }
+
+#ifdef VM
+/* Stops spt_for_each() at the first page it finds, so that the
+   walk succeeds only over an empty range. */
+static bool
+range_is_free (struct page *page UNUSED, void *aux UNUSED) {
+	return false;
+}
+
+void *
+mmap (void *addr, size_t length, int writable, int fd, off_t offset) {
+	struct file *file = process_get_file (fd);
+	uint8_t *end = (uint8_t *) addr + length;
+	off_t file_len;
+
+	if (addr == NULL || pg_ofs (addr) != 0 || offset % PGSIZE != 0
+			|| length == 0 || end < (uint8_t *) addr || !is_user_vaddr (end)
+			|| fd < 2 || file == NULL)
+		return NULL;
+	if (!spt_for_each (&thread_current ()->spt, addr, end, range_is_free, NULL))
+		return NULL;
+
+	lock_acquire (&filesys_lock);
+	file_len = file_length (file);
+	lock_release (&filesys_lock);
+	if (file_len == 0)
+		return NULL;
+
+	return do_mmap (addr, length, writable, file, offset);
+}
+
+void
+munmap (void *addr) {
+	do_munmap (addr);
+}
+
+int
+madvise (void *addr, size_t length, int advice) {
+	uint8_t *end = (uint8_t *) addr + length;
+
+	if (pg_ofs (addr) != 0 || end < (uint8_t *) addr || !is_user_vaddr (addr)
+			|| (length > 0 && !is_user_vaddr (end - 1)))
+		return -1;
+	return vm_madvise (addr, length, advice) ? 0 : -1;
+}
+#endif
@@ -1,7 +1,34 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
+#include <bitmap.h>
+#include <stdio.h>
+#include <string.h>
 #include "vm/vm.h"
+#include "vm/zswap.h"
 #include "devices/disk.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+
+/* Swap is divided into page-sized slots of SLOT_SECTORS sectors.
+ *
+ * Slots are handed out next-fit from a cursor, and pages evicted
+ * in one batch get one contiguous run, so that what leaves memory
+ * together sits together on disk.  A fault on a swapped-out page
+ * reads in the following slots too, if they hold other pages of
+ * the same process (see anon_swap_neighbors()).
+ *
+ * A page keeps its slot after it is read back in, as long as it is
+ * not written to: the slot is a valid copy, so evicting the page
+ * again costs no I/O at all.  The dirty bit of the page tells
+ * whether the copy went stale; if it did, the slot is given up at
+ * the next eviction, and the page gets a fresh one.  When swap runs
+ * short, cached slots of resident pages are given up to make room
+ * (see slot_reclaim()).
+ *
+ * With -zs, the disk sits behind a compressed pool in memory, which
+ * takes every evicted page it can (see vm/zswap.c). */
+#define SLOT_SECTORS (PGSIZE / DISK_SECTOR_SIZE)
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -17,36 +44,250 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+static struct lock swap_lock;       /* Protects the fields below. */
+static struct bitmap *swap_map;     /* Slots in use. */
+static struct page **swap_pages;    /* Page held by each slot. */
+static size_t swap_cursor;          /* Where the next search starts. */
+
+/* Swap I/O counters, in pages. */
+static long long swap_in_cnt;
+static long long swap_out_cnt;
+static long long swap_drop_cnt;     /* Evicted clean, with no write. */
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
-	/* TODO: Set up the swap_disk. */
-	swap_disk = NULL;
+	size_t slot_cnt;
+
+	lock_init (&swap_lock);
+	zswap_init ();
+	swap_disk = disk_get (1, 1);
+	if (swap_disk == NULL)
+		return;
+
+	slot_cnt = disk_size (swap_disk) / SLOT_SECTORS;
+	swap_map = bitmap_create (slot_cnt);
+	swap_pages = calloc (slot_cnt, sizeof *swap_pages);
+	if (swap_map == NULL || swap_pages == NULL)
+		PANIC ("vm_anon_init: cannot allocate %zu swap slots", slot_cnt);
 }
 
 /* Initialize the file mapping */
 bool
-anon_initializer (struct page *page, enum vm_type type, void *kva) {
+anon_initializer (struct page *page, enum vm_type type UNUSED, void *kva) {
 	/* Set up the handler */
 	page->operations = &anon_ops;
 
+	/* A page with nothing to load, like the stack or bss, starts
+	 * out zeroed.  The uninit fields are still intact here.  KVA is
+	 * null if the page is going to the shared zero frame instead. */
+	if (page->uninit.init == NULL && kva != NULL)
+		memset (kva, 0, PGSIZE);
+
 	struct anon_page *anon_page = &page->anon;
+	anon_page->slot = NO_SLOT;
+	anon_page->zhandle = NO_ZHANDLE;
+	return true;
+}
+
+/* Gives SLOT back.  swap_lock must be held. */
+static void
+slot_free (size_t slot) {
+	ASSERT (lock_held_by_current_thread (&swap_lock));
+	bitmap_reset (swap_map, slot);
+	swap_pages[slot] = NULL;
 }
 
 /* Swap in the page by read contents from the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+	disk_sector_t sector;
+
+	if (anon_page->zhandle != NO_ZHANDLE) {
+		zswap_load (anon_page->zhandle, kva);
+		anon_page->zhandle = NO_ZHANDLE;
+		return true;
+	}
+	if (anon_page->slot == NO_SLOT)
+		return false;
+
+	/* The slot stays with the page as its swap cache copy. */
+	sector = anon_page->slot * SLOT_SECTORS;
+	for (int i = 0; i < SLOT_SECTORS; i++)
+		disk_read (swap_disk, sector + i, kva + i * DISK_SECTOR_SIZE);
+
+	lock_acquire (&swap_lock);
+	swap_in_cnt++;
+	lock_release (&swap_lock);
+	return true;
+}
+
+/* Reserves CNT contiguous slots, next-fit from the cursor.  Returns
+ * the first one, or BITMAP_ERROR if there is no such run.
+ * swap_lock must be held. */
+static size_t
+slot_alloc (size_t cnt) {
+	size_t slot = bitmap_scan_and_flip (swap_map, swap_cursor, cnt, false);
+
+	if (slot == BITMAP_ERROR)
+		slot = bitmap_scan_and_flip (swap_map, 0, cnt, false);
+	if (slot != BITMAP_ERROR)
+		swap_cursor = slot + cnt;
+	return slot;
+}
+
+/* Gives up the cached slots of resident pages that nobody is
+ * reading or writing right now, to make room in a full swap.
+ * swap_lock must be held. */
+static void
+slot_reclaim (void) {
+	ASSERT (lock_held_by_current_thread (&swap_lock));
+
+	for (size_t slot = 0; slot < bitmap_size (swap_map); slot++) {
+		struct page *page = swap_pages[slot];
+
+		if (page != NULL && vm_page_is_idle (page)) {
+			slot_free (slot);
+			page->anon.slot = NO_SLOT;
+		}
+	}
+}
+
+/* Writes the CNT anonymous pages in PAGES, which are resident and
+ * kept so by the caller, to swap.  A page whose cached slot is
+ * still current is not written at all.  Of the others, those that
+ * compress well go to the zswap pool, and the rest get consecutive
+ * slots on disk if possible, and single free slots otherwise.
+ * Returns false, with no page stored anywhere, if swap is full. */
+bool
+anon_swap_out_batch (struct page *pages[], size_t cnt) {
+	struct page *dirty[cnt];
+	size_t slots[cnt];
+	size_t dirty_cnt = 0, disk_cnt = 0;
+	size_t run;
+
+	lock_acquire (&swap_lock);
+	for (size_t i = 0; i < cnt; i++) {
+		struct anon_page *anon_page = &pages[i]->anon;
+
+		if (anon_page->slot != NO_SLOT) {
+			if (!pml4_is_dirty (pages[i]->owner->pml4, pages[i]->va)) {
+				swap_drop_cnt++;
+				continue;
+			}
+			slot_free (anon_page->slot);
+			anon_page->slot = NO_SLOT;
+		}
+		dirty[dirty_cnt++] = pages[i];
+	}
+	lock_release (&swap_lock);
+
+	/* The pages left in DIRTY[0, DISK_CNT) are those the pool would
+	 * not take. */
+	for (size_t i = 0; i < dirty_cnt; i++) {
+		dirty[i]->anon.zhandle = zswap_store (dirty[i]->frame->kva);
+		if (dirty[i]->anon.zhandle == NO_ZHANDLE)
+			dirty[disk_cnt++] = dirty[i];
+	}
+	if (disk_cnt == 0)
+		return true;
+	if (swap_disk == NULL)
+		goto fail;
+
+	lock_acquire (&swap_lock);
+	if (bitmap_count (swap_map, 0, bitmap_size (swap_map), false) < disk_cnt)
+		slot_reclaim ();
+	run = slot_alloc (disk_cnt);
+	for (size_t i = 0; i < disk_cnt; i++) {
+		slots[i] = run != BITMAP_ERROR ? run + i : slot_alloc (1);
+		if (slots[i] == BITMAP_ERROR) {
+			while (i-- > 0)
+				slot_free (slots[i]);
+			lock_release (&swap_lock);
+			goto fail;
+		}
+		swap_pages[slots[i]] = dirty[i];
+	}
+	lock_release (&swap_lock);
+
+	for (size_t i = 0; i < disk_cnt; i++) {
+		disk_sector_t sector = slots[i] * SLOT_SECTORS;
+		uint8_t *kva = dirty[i]->frame->kva;
+
+		for (int j = 0; j < SLOT_SECTORS; j++)
+			disk_write (swap_disk, sector + j, kva + j * DISK_SECTOR_SIZE);
+		dirty[i]->anon.slot = slots[i];
+	}
+
+	lock_acquire (&swap_lock);
+	swap_out_cnt += disk_cnt;
+	lock_release (&swap_lock);
+	return true;
+
+fail:
+	for (size_t i = 0; i < cnt; i++)
+		if (pages[i]->anon.zhandle != NO_ZHANDLE) {
+			zswap_free (pages[i]->anon.zhandle);
+			pages[i]->anon.zhandle = NO_ZHANDLE;
+		}
+	return false;
 }
 
 /* Swap out the page by writing contents to the swap disk. */
 static bool
 anon_swap_out (struct page *page) {
-	struct anon_page *anon_page = &page->anon;
+	return anon_swap_out_batch (&page, 1);
+}
+
+/* Stores in OUT up to MAX pages of the current process that sit in
+ * the swap slots right after PAGE's, stopping at the first slot
+ * that does not qualify.  Returns how many were stored.  These are
+ * worth reading in with PAGE while the disk is positioned there. */
+size_t
+anon_swap_neighbors (struct page *page, struct page *out[], size_t max) {
+	size_t cnt = 0;
+
+	if (page->operations != &anon_ops || page->anon.slot == NO_SLOT)
+		return 0;
+
+	lock_acquire (&swap_lock);
+	for (size_t slot = page->anon.slot + 1;
+			cnt < max && slot < bitmap_size (swap_map); slot++) {
+		struct page *next = swap_pages[slot];
+		if (next == NULL || next->owner != thread_current ()
+				|| next->frame != NULL)
+			break;
+		out[cnt++] = next;
+	}
+	lock_release (&swap_lock);
+	return cnt;
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	vm_free_frame (page);
+	if (anon_page->zhandle != NO_ZHANDLE)
+		zswap_free (anon_page->zhandle);
+	if (anon_page->slot != NO_SLOT) {
+		lock_acquire (&swap_lock);
+		slot_free (anon_page->slot);
+		lock_release (&swap_lock);
+	}
+}
+
+/* Prints swap statistics. */
+void
+vm_anon_print_stats (void) {
+	zswap_print_stats (swap_in_cnt);
+	if (swap_disk == NULL)
+		return;
+	printf ("Swap: %s: %lld pages out, %lld pages in, %lld clean pages "
+			"dropped, %zu of %zu slots in use\n",
+			"hd1:1", swap_out_cnt, swap_in_cnt, swap_drop_cnt,
+			bitmap_count (swap_map, 0, bitmap_size (swap_map), true),
+			bitmap_size (swap_map));
 }
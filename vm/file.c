@@ -1,10 +1,18 @@
 /* file.c: Implementation of memory backed file object (mmaped object). */
 
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
 #include "vm/vm.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
 static void file_backed_destroy (struct page *page);
+static void file_backed_writeback (struct page *page);
 
 /* DO NOT MODIFY this struct */
 static const struct page_operations file_ops = {
@@ -21,38 +29,279 @@ vm_file_init (void) {
 
 /* Initialize the file backed page */
 bool
-file_backed_initializer (struct page *page, enum vm_type type, void *kva) {
+file_backed_initializer (struct page *page, enum vm_type type UNUSED,
+		void *kva UNUSED) {
 	/* Set up the handler */
 	page->operations = &file_ops;
 
-	struct file_page *file_page = &page->file;
+	/* The fields of page->file are filled in by the lazy loader
+	 * or, on fork, by the copy of the parent's page. */
+	return true;
 }
 
 /* Swap in the page by read contents from the file. */
 static bool
 file_backed_swap_in (struct page *page, void *kva) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+	bool locked = vm_lock_filesys ();
+	off_t read = file_read_at (file_page->file, kva, file_page->read_bytes,
+			file_page->ofs);
+
+	vm_unlock_filesys (locked);
+	if (read != (off_t) file_page->read_bytes)
+		return false;
+	memset (kva + file_page->read_bytes, 0, PGSIZE - file_page->read_bytes);
+	return true;
 }
 
 /* Swap out the page by writeback contents to the file. */
 static bool
 file_backed_swap_out (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	/* A clean page is simply dropped and read again on next use. */
+	file_backed_writeback (page);
+	return true;
+}
+
+/* Writes PAGE, which must be resident and kept so by the caller,
+ * back to its file if the user modified it. */
+static void
+file_backed_writeback (struct page *page) {
+	struct file_page *file_page = &page->file;
+	uint64_t *pml4 = page->owner->pml4;
+
+	if (pml4 == NULL || !pml4_is_dirty (pml4, page->va))
+		return;
+
+	bool locked = vm_lock_filesys ();
+	file_write_at (file_page->file, page->frame->kva, file_page->read_bytes,
+			file_page->ofs);
+	vm_unlock_filesys (locked);
+	pml4_set_dirty (pml4, page->va, false);
+}
+
+/* Most pages written back in one file_write_at(). */
+#define WB_RUN 16
+
+/* Batched writeback statistics. */
+static long long wb_page_cnt;   /* Dirty pages written back... */
+static long long wb_run_cnt;    /* ...in this many writes. */
+
+/* Dirty pages gathered for vm_file_writeback(). */
+struct wb_list {
+	struct page **pages;    /* Null while counting candidates. */
+	size_t cnt;             /* Pages in PAGES, or candidates. */
+	size_t cap;             /* Room in PAGES. */
+};
+
+/* Counts PAGE into the wb_list in AUX if it is a loaded file page,
+ * or, once the list has room, adds it if it is resident and dirty,
+ * pinned so that it stays so. */
+static bool
+collect_dirty (struct page *page, void *list_) {
+	struct wb_list *list = list_;
+
+	if (VM_TYPE (page->operations->type) != VM_FILE
+			|| page->owner->pml4 == NULL)
+		return true;
+	if (list->pages == NULL) {
+		list->cnt++;
+		return true;
+	}
+	if (list->cnt == list->cap || !vm_pin_page (page))
+		return true;
+	if (pml4_is_dirty (page->owner->pml4, page->va))
+		list->pages[list->cnt++] = page;
+	else
+		vm_unpin_page (page);
+	return true;
+}
+
+/* Orders pages by file, then by offset. */
+static int
+compare_file_pos (const void *a_, const void *b_) {
+	const struct page *a = *(struct page *const *) a_;
+	const struct page *b = *(struct page *const *) b_;
+	disk_sector_t ia = inode_get_inumber (file_get_inode (a->file.file));
+	disk_sector_t ib = inode_get_inumber (file_get_inode (b->file.file));
+
+	if (ia != ib)
+		return ia < ib ? -1 : 1;
+	return a->file.ofs < b->file.ofs ? -1 : a->file.ofs > b->file.ofs;
+}
+
+/* Returns true if page B directly follows page A in the same file. */
+static bool
+file_pages_adjacent (const struct page *a, const struct page *b) {
+	return file_get_inode (a->file.file) == file_get_inode (b->file.file)
+		&& a->file.read_bytes == PGSIZE
+		&& b->file.ofs == a->file.ofs + PGSIZE;
+}
+
+/* Writes back the dirty file pages of SPT in [START, END) before
+ * they are destroyed, as munmap and exit do, so that their destroy
+ * handlers find them clean.  Rather than one write per page in
+ * address order, the pages are sorted by file and offset, and each
+ * run of up to WB_RUN adjacent pages is copied together and written
+ * with one file_write_at(), which the inode layer turns into
+ * multi-sector disk writes.  Clean pages cost nothing. */
+void
+vm_file_writeback (struct supplemental_page_table *spt, void *start,
+		void *end) {
+	struct wb_list list = { NULL, 0, 0 };
+	uint8_t *bounce;
+	size_t run_max;
+	bool locked;
+
+	spt_for_each (spt, start, end, collect_dirty, &list);
+	if (list.cnt == 0)
+		return;
+	list.pages = malloc (list.cnt * sizeof *list.pages);
+	if (list.pages == NULL)
+		return;
+	list.cap = list.cnt;
+	list.cnt = 0;
+	spt_for_each (spt, start, end, collect_dirty, &list);
+	qsort (list.pages, list.cnt, sizeof *list.pages, compare_file_pos);
+
+	/* Without a bounce buffer, each page is written from its frame. */
+	bounce = palloc_get_multiple (0, WB_RUN);
+	run_max = bounce != NULL ? WB_RUN : 1;
+
+	locked = vm_lock_filesys ();
+	for (size_t i = 0, n; i < list.cnt; i += n) {
+		struct page **run = list.pages + i;
+		struct page *last;
+
+		for (n = 1; i + n < list.cnt && n < run_max; n++)
+			if (!file_pages_adjacent (run[n - 1], run[n]))
+				break;
+		last = run[n - 1];
+
+		if (n == 1)
+			file_write_at (last->file.file, last->frame->kva,
+					last->file.read_bytes, last->file.ofs);
+		else {
+			for (size_t j = 0; j < n; j++)
+				memcpy (bounce + j * PGSIZE, run[j]->frame->kva, PGSIZE);
+			file_write_at (run[0]->file.file, bounce,
+					(n - 1) * PGSIZE + last->file.read_bytes, run[0]->file.ofs);
+		}
+		for (size_t j = 0; j < n; j++) {
+			pml4_set_dirty (run[j]->owner->pml4, run[j]->va, false);
+			vm_unpin_page (run[j]);
+		}
+		wb_page_cnt += n;
+		wb_run_cnt++;
+	}
+	vm_unlock_filesys (locked);
+
+	if (bounce != NULL)
+		palloc_free_multiple (bounce, WB_RUN);
+	free (list.pages);
+}
+
+/* Prints batched writeback statistics. */
+void
+vm_file_print_stats (void) {
+	printf ("VM: %lld dirty file pages written back in %lld runs\n",
+			wb_page_cnt, wb_run_cnt);
 }
 
 /* Destory the file backed page. PAGE will be freed by the caller. */
 static void
 file_backed_destroy (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	/* Pinning waits out an eviction in progress and keeps the
+	 * frame in place while it is written back. */
+	if (vm_pin_page (page)) {
+		file_backed_writeback (page);
+		vm_unpin_page (page);
+	}
+	vm_free_frame (page);
+	file_close (file_page->file);
+}
+
+/* First fault on an mmap page: takes over the file_page in AUX and
+ * reads the contents. */
+static bool
+file_lazy_load (struct page *page, void *aux) {
+	page->file = *(struct file_page *) aux;
+	free (aux);
+	return file_backed_swap_in (page, page->frame->kva);
+}
+
+/* Returns where PAGE, a VM_FILE page that may not have been
+ * touched yet, comes from. */
+static struct file_page *
+file_info (struct page *page) {
+	if (VM_TYPE (page->operations->type) == VM_UNINIT)
+		return page->uninit.aux;
+	return &page->file;
 }
 
 /* Do the mmap */
 void *
 do_mmap (void *addr, size_t length, int writable,
 		struct file *file, off_t offset) {
+	size_t file_left = (size_t) offset < (size_t) file_length (file)
+		? file_length (file) - offset : 0;
+
+	for (size_t ofs = 0; ofs < length; ofs += PGSIZE) {
+		struct file_page *aux = malloc (sizeof *aux);
+
+		if (aux == NULL)
+			goto fail;
+		aux->file = file_reopen (file);
+		if (aux->file == NULL) {
+			free (aux);
+			goto fail;
+		}
+		aux->ofs = offset + ofs;
+		aux->read_bytes = file_left < PGSIZE ? file_left : PGSIZE;
+		aux->map_base = addr;
+		aux->map_len = length;
+		file_left -= aux->read_bytes;
+
+		if (!vm_alloc_page_with_initializer (VM_FILE, addr + ofs, writable,
+					file_lazy_load, aux)) {
+			file_close (aux->file);
+			free (aux);
+			goto fail;
+		}
+	}
+	return addr;
+
+fail:
+	do_munmap (addr);
+	return NULL;
+}
+
+/* Removes PAGE from the table in AUX. */
+static bool
+unmap_page (struct page *page, void *spt) {
+	spt_remove_page (spt, page);
+	return true;
 }
 
 /* Do the munmap */
 void
 do_munmap (void *addr) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct page *page = spt_find_page (spt, addr);
+	struct file_page *info;
+	void *end;
+
+	if (page == NULL || page_get_type (page) != VM_FILE)
+		return;
+	info = file_info (page);
+	if (info->map_base != addr)
+		return;
+
+	/* Writes back the dirty pages of the region in file order,
+	 * unmaps the region at once, then destroys the pages. */
+	end = (uint8_t *) addr + ROUND_UP (info->map_len, PGSIZE);
+	vm_file_writeback (spt, addr, end);
+	vm_clear_range (addr, end);
+	spt_for_each (spt, addr, end, unmap_page, spt);
 }
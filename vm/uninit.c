@@ -8,6 +8,7 @@
  * function.
  * */
 
+#include "threads/malloc.h"
 #include "vm/vm.h"
 #include "vm/uninit.h"
 
@@ -62,7 +63,13 @@ uninit_initialize (struct page *page, void *kva) {
  * PAGE will be freed by the caller. */
 static void
 uninit_destroy (struct page *page) {
-	struct uninit_page *uninit UNUSED = &page->uninit;
-	/* TODO: Fill this function.
-	 * TODO: If you don't have anything to do, just return. */
+	struct uninit_page *uninit = &page->uninit;
+	struct file_page *info = uninit->aux;
+
+	/* Lazily loaded pages carry a struct file_page saying where
+	 * their contents come from; see file.h. */
+	if (info != NULL) {
+		file_close (info->file);
+		free (info);
+	}
 }
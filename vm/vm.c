@@ -1,9 +1,166 @@
 /* vm.c: Generic interface for virtual memory objects. */
 
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall-nr.h>
+#include "devices/timer.h"
+#include "filesys/inode.h"
+#include "filesys/page_cache.h"
+#include "threads/init.h"
 #include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "userprog/syscall.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
 
+/* Protects the frame table: the page/frame links, and ref_cnt,
+ * pin_cnt and flags of every frame, and the clock hand.  Never held across I/O;
+ * a frame being written out is marked FRAME_LOCKED instead, and
+ * FRAME_COND is signalled when that mark is cleared. */
+static struct lock frame_lock;
+static struct condition frame_cond;
+
+/* Next frame the clock hand will look at, an index into mem_map. */
+static size_t clock_hand;
+
+/* A frame of zeros, mapped read-only for reads of anonymous pages
+ * that were never written.  It is pinned and holds a reference of
+ * its own, so it is never evicted and looks shared to every page
+ * on it; the first write gives the page a frame of its own.  Pages
+ * on it are not chained, since there may be very many. */
+static struct frame *zero_frame;
+
+/* Index of the frames that hold program text, so that processes
+ * running the same executable map the same frames instead of each
+ * reading its own copy.  An entry lives as long as its frame has
+ * any page, and is protected by frame_lock.  Only read-only
+ * segments are indexed.  Each entry keeps the executable's inode
+ * open, so that no other file can take its place while the entry
+ * lives, and is dropped as soon as the file is written to or
+ * removed (see vm_text_forget()). */
+struct text_frame {
+	struct hash_elem elem;
+	struct inode *inode;    /* The executable, held open. */
+	off_t ofs;              /* Offset of the page in it. */
+	size_t read_bytes;      /* Bytes from the file; the rest is zero. */
+	struct frame *frame;
+	struct text_file *file; /* Entry of the inode in text_files. */
+	struct list_elem file_elem;     /* In FILE's list, or text_dead. */
+};
+
+/* The entries of one executable in the text index. */
+struct text_file {
+	struct hash_elem elem;
+	struct inode *inode;
+	struct list frames;     /* Its struct text_frames. */
+};
+
+static struct hash text_index;
+static struct hash text_files;
+
+/* Entries dropped under frame_lock, whose inode is yet to be closed
+ * by text_reap(), which needs the file system lock. */
+static struct list text_dead;
+
+/* Text pages mapped from another process's frame. */
+static long long text_share_cnt;
+
+/* mmap pages mapped to the page cache's copy. */
+static long long cache_map_cnt;
+
+static hash_hash_func text_hash;
+static hash_less_func text_less;
+static hash_hash_func text_file_hash;
+static hash_less_func text_file_less;
+static void text_drop (struct text_frame *);
+
+/* -wl=PAGES, -wh=PAGES: The reclaim daemon wakes up when fewer
+ * than reclaim_low_pages user frames are free, and evicts until
+ * reclaim_high_pages are.  A low watermark of 0 turns it off. */
+size_t reclaim_low_pages = 32;
+size_t reclaim_high_pages = 64;
+
+static struct semaphore kswapd_sema;    /* Upped to wake the daemon. */
+static bool kswapd_awake;               /* Already woken? */
+
+/* Reclaim statistics. */
+static long long kswapd_wakeups;        /* Times the daemon ran. */
+static long long kswapd_evict_cnt;      /* Frames it freed. */
+static long long frame_alloc_cnt;       /* Calls to vm_get_frame(). */
+static long long direct_reclaim_cnt;    /* Of those, that had to evict. */
+static long long direct_evict_cnt;      /* Frames they freed. */
+
+static void kswapd (void *aux);
+
+/* Same-page merging.  The daemon walks mem_map[] at
+ * ksm_pages_per_sec anonymous frames a second and merges frames
+ * with the same contents into one, shared copy-on-write like a
+ * forked page.  A frame is only considered once its checksum has
+ * not changed for a full pass, to leave alone pages still being
+ * written.  Candidates of the current pass are kept in ksm_seen by
+ * checksum, and the table is emptied at the end of each pass. */
+size_t ksm_pages_per_sec;
+
+/* A frame seen in this pass. */
+struct ksm_item {
+	struct hash_elem elem;
+	uint32_t sum;           /* Checksum of its contents. */
+	struct frame *frame;
+};
+
+static struct hash ksm_seen;
+static uint32_t *ksm_sums;              /* Last checksum of each frame. */
+static uint32_t ksm_zero_sum;           /* Checksum of a page of zeros. */
+
+/* Times a second the daemon runs. */
+#define KSM_HZ 10
+
+/* Merging statistics. */
+static long long ksm_scan_cnt;          /* Frames checksummed. */
+static long long ksm_pass_cnt;          /* Full passes over mem_map. */
+static long long ksm_merge_cnt;         /* Pages moved to another frame. */
+static long long ksm_zero_cnt;          /* Of those, to the zero frame. */
+static int64_t ksm_ticks;               /* Spent scanning. */
+
+static hash_hash_func ksm_hash;
+static hash_less_func ksm_less;
+static void ksmd (void *aux);
+
+/* Transparent huge pages.  With -hp, the khugepaged daemon looks
+ * for 2 MB-aligned runs of HUGE_PGCNT resident, private anonymous
+ * pages of one process, and moves each run to a 2 MB frame mapped
+ * by a single page directory entry, so that it takes one TLB entry
+ * instead of 512.  Every page keeps a struct frame of its own
+ * within the run, marked FRAME_HUGE.  Whatever needs one page
+ * mapped on its own, like eviction, fork or unmapping, splits the
+ * mapping back into 4 kB entries first; the frames stay put. */
+#define THP_SCAN_MS 100         /* Between scans of mem_map. */
+#define THP_COLLAPSE_MAX 4      /* Most runs collapsed per scan. */
+
+static long long thp_collapse_cnt;      /* 2 MB pages made... */
+static long long thp_split_cnt;         /* ...and split again. */
+
+static void khugepaged (void *aux);
+
+/* Working sets.  Every ws_sample_ms, the sampling daemon checks the
+ * accessed bit of every resident page, and counts the pages found
+ * accessed toward their process's working set of that pass.  The
+ * bit is cleared for the next pass, so the page is marked
+ * referenced instead for the clock hand to see.
+ *
+ * A process with more than rss_soft_limit resident pages gets no
+ * second chance from the clock hand, so that it gives up its own
+ * pages first when memory runs short. */
+size_t ws_sample_ms;
+size_t rss_soft_limit;
+
+static size_t ws_epoch;                 /* Number of the current pass. */
+static long long rss_limit_evict_cnt;   /* Victims over their limit. */
+
+static void ws_sampler (void *aux);
+
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
 void
@@ -15,7 +172,44 @@ vm_init (void) {
 #endif
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
-	/* TODO: Your code goes here. */
+	lock_init (&frame_lock);
+	cond_init (&frame_cond);
+
+	void *zero_kva = palloc_get_page (PAL_USER | PAL_ZERO);
+	if (zero_kva == NULL)
+		PANIC ("vm_init: no frame for the zero page");
+	zero_frame = frame_of (zero_kva);
+	zero_frame->ref_cnt = 1;
+	zero_frame->pin_cnt = 1;
+
+	if (!hash_init (&text_index, text_hash, text_less, NULL)
+			|| !hash_init (&text_files, text_file_hash, text_file_less, NULL))
+		PANIC ("vm_init: cannot create the text index");
+	list_init (&text_dead);
+
+	sema_init (&kswapd_sema, 0);
+	if (reclaim_high_pages < reclaim_low_pages)
+		reclaim_high_pages = reclaim_low_pages;
+	if (reclaim_low_pages > 0
+			&& thread_create ("kswapd", PRI_DEFAULT, kswapd, NULL) == TID_ERROR)
+		PANIC ("vm_init: cannot start the reclaim daemon");
+
+	if (ksm_pages_per_sec > 0) {
+		ksm_sums = calloc (mem_map_cnt, sizeof *ksm_sums);
+		if (ksm_sums == NULL || !hash_init (&ksm_seen, ksm_hash, ksm_less, NULL))
+			PANIC ("vm_init: cannot set up page merging");
+		ksm_zero_sum = hash_bytes (zero_kva, PGSIZE);
+		if (thread_create ("ksmd", PRI_DEFAULT, ksmd, NULL) == TID_ERROR)
+			PANIC ("vm_init: cannot start the page merging daemon");
+	}
+
+	if (user_huge_pages && thread_create ("khugepaged", PRI_DEFAULT,
+				khugepaged, NULL) == TID_ERROR)
+		PANIC ("vm_init: cannot start the huge page daemon");
+
+	if (ws_sample_ms > 0 && thread_create ("wssample", PRI_DEFAULT,
+				ws_sampler, NULL) == TID_ERROR)
+		PANIC ("vm_init: cannot start the working set sampler");
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -35,7 +229,43 @@ page_get_type (struct page *page) {
 /* Helpers */
 static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
-static struct frame *vm_evict_frame (void);
+static bool install_frame (struct page *page, struct frame *frame);
+static struct frame *vm_evict_frame (long long *freed_cnt);
+
+/* The stack may grow down to this many bytes below USER_STACK. */
+#define STACK_LIMIT (1 << 20)
+
+/* Levels of the SPT radix tree, as in the page table. */
+#define SPT_LEVELS 4
+
+/* Most anonymous pages written to swap in one eviction. */
+#define EVICT_BATCH 8
+
+/* Most swapped-out neighbors read in along with a faulting page. */
+#define SWAP_READAHEAD 4
+
+/* Pages read from swap ahead of a fault. */
+static long long swap_readahead_cnt;
+
+/* -fa=PAGES: Size of the window of program text loaded around a
+ * fault, or 0 to load one page per fault. */
+size_t fault_around_pages = 16;
+
+/* Pages loaded around faults, each a fault avoided if used. */
+static long long fault_around_cnt;
+
+/* Pages read ahead of a fault under MADV_SEQUENTIAL, and dropped
+ * behind it. */
+#define SEQ_WINDOW 32
+static long long seq_readahead_cnt;
+static long long seq_drop_cnt;
+
+/* Copy-on-write statistics. */
+static long long cow_share_cnt;     /* Pages shared by fork. */
+static long long cow_copy_cnt;      /* Pages copied on a write. */
+static long long cow_reuse_cnt;     /* Written when no longer shared. */
+static long long zero_map_cnt;      /* Read faults on the zero frame. */
+static int64_t fork_ticks;          /* Spent copying page tables. */
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -50,94 +280,1442 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 	/* Check wheter the upage is already occupied or not. */
 	if (spt_find_page (spt, upage) == NULL) {
-		/* TODO: Create the page, fetch the initialier according to the VM type,
-		 * TODO: and then create "uninit" page struct by calling uninit_new. You
-		 * TODO: should modify the field after calling the uninit_new. */
+		bool (*initializer) (struct page *, enum vm_type, void *);
+		struct page *page;
 
-		/* TODO: Insert the page into the spt. */
+		switch (VM_TYPE (type)) {
+			case VM_ANON:
+				initializer = anon_initializer;
+				break;
+			case VM_FILE:
+				initializer = file_backed_initializer;
+				break;
+			default:
+				goto err;
+		}
+
+		page = malloc (sizeof *page);
+		if (page == NULL)
+			goto err;
+		uninit_new (page, upage, init, type, aux, initializer);
+		page->owner = thread_current ();
+		page->writable = writable;
+
+		if (!spt_insert_page (spt, page)) {
+			free (page);
+			goto err;
+		}
+		return true;
 	}
 err:
 	return false;
 }
 
+/* Returns the leaf slot of SPT for VA.  Missing nodes on the way
+ * are allocated if CREATE is true; otherwise, or if that fails,
+ * returns NULL. */
+static void **
+spt_slot (struct supplemental_page_table *spt, const void *va, bool create) {
+	const size_t idx[SPT_LEVELS] = { PML4 (va), PDPE (va), PDX (va), PTX (va) };
+	void **slot = (void **) &spt->root;
+
+	for (int level = 0; level < SPT_LEVELS; level++) {
+		if (*slot == NULL) {
+			if (!create)
+				return NULL;
+			*slot = palloc_get_page (PAL_ZERO);
+			if (*slot == NULL)
+				return NULL;
+		}
+		slot = (void **) *slot + idx[level];
+	}
+	return slot;
+}
+
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
-spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function. */
+spt_find_page (struct supplemental_page_table *spt, void *va) {
+	void **slot;
 
-	return page;
+	if (spt->root == NULL)
+		return NULL;
+	slot = spt_slot (spt, pg_round_down (va), false);
+	return slot != NULL ? *slot : NULL;
 }
 
 /* Insert PAGE into spt with validation. */
 bool
-spt_insert_page (struct supplemental_page_table *spt UNUSED,
-		struct page *page UNUSED) {
-	int succ = false;
-	/* TODO: Fill this function. */
+spt_insert_page (struct supplemental_page_table *spt, struct page *page) {
+	void **slot;
 
-	return succ;
+	ASSERT (pg_ofs (page->va) == 0);
+
+	slot = spt_slot (spt, page->va, true);
+	if (slot == NULL || *slot != NULL)
+		return false;
+	*slot = page;
+	spt->page_cnt++;
+	return true;
 }
 
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
+	void **slot = spt_slot (spt, page->va, false);
+
+	ASSERT (slot != NULL && *slot == page);
+	*slot = NULL;
+	spt->page_cnt--;
 	vm_dealloc_page (page);
+}
+
+/* Calls FUNC on the pages under NODE, a node at LEVEL whose first
+ * slot covers BASE, that lie in [START, END), in address order. */
+static bool
+spt_walk (void **node, int level, uint64_t base, uint64_t start,
+		uint64_t end, spt_page_func *func, void *aux) {
+	const uint64_t span = 1UL << (PTXSHIFT + 9 * (SPT_LEVELS - 1 - level));
+	size_t i = start > base ? (start - base) / span : 0;
+
+	for (; i < SPT_FANOUT && base + i * span < end; i++) {
+		void *entry = node[i];
+
+		if (entry == NULL)
+			continue;
+		if (level == SPT_LEVELS - 1) {
+			if (!func (entry, aux))
+				return false;
+		} else if (!spt_walk (entry, level + 1, base + i * span,
+					start, end, func, aux))
+			return false;
+	}
 	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Calls FUNC with AUX on every page of SPT in [START, END), in
+ * ascending address order, skipping unpopulated parts of the tree
+ * entirely.  Stops and returns false as soon as FUNC does. */
+bool
+spt_for_each (struct supplemental_page_table *spt, void *start, void *end,
+		spt_page_func *func, void *aux) {
+	if (spt->root == NULL)
+		return true;
+	return spt_walk (spt->root, 0, 0, (uint64_t) pg_round_down (start),
+			(uint64_t) end, func, aux);
+}
+
+/* Frees NODE, a node at LEVEL, and the nodes below it. */
+static void
+spt_free_node (void **node, int level) {
+	if (level < SPT_LEVELS - 1)
+		for (size_t i = 0; i < SPT_FANOUT; i++)
+			if (node[i] != NULL)
+				spt_free_node (node[i], level + 1);
+	palloc_free_page (node);
+}
+
+/* Returns true if PAGE, which is resident, can be dropped
+ * without writing it anywhere: a file page, or an anonymous page
+ * with a swap slot, that was not written since it came in. */
+static bool
+page_is_clean (struct page *page) {
+	if (page_get_type (page) == VM_ANON && page->anon.slot == NO_SLOT)
+		return false;
+	return !pml4_is_dirty (page->owner->pml4, page->va);
+}
+
+/* Returns true if any page sharing FRAME was accessed since the
+ * last call, and clears their accessed bits and referenced marks. */
+static bool
+frame_accessed (struct frame *frame) {
+	bool accessed = false;
+
+	for (struct page *p = frame->page; p != NULL; p = p->next_sharer) {
+		if (pml4_is_accessed (p->owner->pml4, p->va)) {
+			pml4_set_accessed (p->owner->pml4, p->va, false);
+			accessed = true;
+		}
+		if (p->referenced) {
+			p->referenced = false;
+			accessed = true;
+		}
+	}
+	return accessed;
+}
+
+/* Adds PAGE to the pages sharing FRAME.  frame_lock must be held. */
+static void
+frame_link (struct frame *frame, struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	page->frame = frame;
+	frame->ref_cnt++;
+	if (frame != zero_frame) {
+		page->next_sharer = frame->page;
+		frame->page = page;
+		if (++page->owner->rss > page->owner->rss_peak)
+			page->owner->rss_peak = page->owner->rss;
+	}
+}
+
+/* Takes PAGE off the pages sharing its frame.  Returns true if no
+ * page is left, in which case the frame is reset for reuse, but
+ * still allocated.  A frame of the page cache stays as it is, and
+ * false is returned.  frame_lock must be held. */
+static bool
+frame_unlink (struct page *page) {
+	struct frame *frame = page->frame;
+	struct page **p = &frame->page;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (frame == zero_frame) {
+		page->frame = NULL;
+		frame->ref_cnt--;
+		return false;
+	}
+	while (*p != page)
+		p = &(*p)->next_sharer;
+	*p = page->next_sharer;
+	page->next_sharer = NULL;
+	page->frame = NULL;
+	page->owner->rss--;
+	if (--frame->ref_cnt > 0 || (frame->flags & FRAME_CACHE))
+		return false;
+	frame->pin_cnt = 0;
+	frame->flags = 0;
+	if (frame->text != NULL)
+		text_drop (frame->text);
+	return true;
+}
+
+/* Maps PAGE to its frame in its owner's page table.  A frame that
+ * other pages share is mapped read-only, whatever PAGE's own
+ * permission, so that a write to it faults into vm_handle_wp().
+ * A frame of the page cache is the file's only copy in memory, so
+ * it is never copied on write: every page on it is mapped as its
+ * own permission says.  frame_lock must be held. */
+static bool
+map_page (struct page *page) {
+	struct frame *frame = page->frame;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	return pml4_set_page (page->owner->pml4, page->va, frame->kva,
+			page->writable
+			&& (frame->ref_cnt == 1 || (frame->flags & FRAME_CACHE)));
+}
+
+/* Returns the first frame of the 2 MB frame that FRAME is in. */
+static struct frame *
+huge_head (struct frame *frame) {
+	return frame_of ((void *) ((uint64_t) frame->kva & ~(HUGE_PGSIZE - 1)));
+}
+
+/* Splits the 2 MB mapping that FRAME, marked FRAME_HUGE, is part
+ * of into 4 kB mappings of the same frames.  If the address space
+ * is being torn down, the mapping is gone already, and the frames
+ * only lose their mark.  Returns false if there is no memory for
+ * the page table.  frame_lock must be held. */
+static bool
+split_huge (struct frame *frame) {
+	struct frame *head = huge_head (frame);
+	struct page *page = head->page;
+	uint64_t *pde;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+	ASSERT (frame->flags & FRAME_HUGE);
+
+	pde = page->owner->pml4 != NULL
+		? pml4e_walk_pde (page->owner->pml4, (uint64_t) page->va, 0) : NULL;
+	if (pde != NULL && (*pde & PTE_PS)) {
+		if (!pml4_split_huge_page (page->owner->pml4, page->va))
+			return false;
+		thp_split_cnt++;
+	}
+	for (size_t i = 0; i < HUGE_PGCNT; i++)
+		head[i].flags &= ~FRAME_HUGE;
+	return true;
+}
+
+/* Get the struct frame, that will be evicted.
+ *
+ * The clock hand sweeps mem_map[] in frame order.  A frame whose
+ * page was accessed since the last sweep gets a second chance: its
+ * accessed bit is cleared and the hand moves on.  Among frames not
+ * accessed, a clean one is taken at once; the first dirty one is
+ * remembered and taken only if a full turn finds no clean one.
+ * Pinned frames and frames already on their way out are skipped.
+ * A frame counts as accessed if any page sharing it was.  A 2 MB
+ * page has one accessed bit, so if it is set the hand skips the
+ * whole of it; otherwise it is split, and its frames are taken one
+ * by one.  A frame whose first page belongs to a process over
+ * rss_soft_limit is taken at once.
+ * A frame that several pages share takes one eviction per sharer
+ * to free, so it is passed over; the first one not accessed is
+ * taken only if the scan finds no private frame at all.
+ * The scan gives up after two turns.  frame_lock must be held. */
 static struct frame *
 vm_get_victim (void) {
 	struct frame *victim = NULL;
-	 /* TODO: The policy for eviction is up to you. */
+	struct frame *shared = NULL;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	for (size_t n = 0; n < 2 * mem_map_cnt; n++) {
+		struct frame *frame = &mem_map[clock_hand];
+		struct page *page = frame->page;
+
+		clock_hand = (clock_hand + 1) % mem_map_cnt;
+		if (page == NULL || frame->pin_cnt > 0 || (frame->flags & FRAME_LOCKED))
+			continue;
+
+		bool over_limit = rss_soft_limit > 0
+			&& page->owner->rss > rss_soft_limit;
+
+		if (frame->flags & FRAME_HUGE) {
+			if (!over_limit && frame_accessed (frame)) {
+				clock_hand = (huge_head (frame) - mem_map + HUGE_PGCNT)
+					% mem_map_cnt;
+				continue;
+			}
+			if (!split_huge (frame))
+				continue;
+		}
 
-	return victim;
+		if (frame->ref_cnt > 1) {
+			if (shared == NULL && !frame_accessed (frame))
+				shared = frame;
+			continue;
+		}
+		if (over_limit) {
+			rss_limit_evict_cnt++;
+			return frame;
+		}
+		if (frame_accessed (frame))
+			continue;
+		else if (page_is_clean (page))
+			return frame;
+		else if (victim == NULL)
+			victim = frame;
+
+		if (victim != NULL && n >= mem_map_cnt)
+			break;
+	}
+	return victim != NULL ? victim : shared;
 }
 
 /* Evict one page and return the corresponding frame.
- * Return NULL on error.*/
+ * Return NULL on error.
+ *
+ * Victims are unmapped and marked FRAME_LOCKED under frame_lock,
+ * then written out without it, so that other threads can keep
+ * faulting while the disk works.  Anyone who needs one of the
+ * pages in the meantime waits on frame_cond.
+ *
+ * When the first victim is anonymous, it has to go to swap anyway,
+ * so up to EVICT_BATCH anonymous victims are taken together and
+ * written to consecutive slots in one pass.  The frames beyond the
+ * first go back to the user pool for the next faults.
+ *
+ * Only the first page of a shared frame is evicted at a time; the
+ * frame is freed once the last one is.  Until then, the sweep goes
+ * on.  vm_get_victim() picks shared frames only when no private one
+ * is left, so this is the exception rather than the rule.
+ *
+ * The number of frames freed is added to *FREED_CNT. */
 static struct frame *
-vm_evict_frame (void) {
-	struct frame *victim UNUSED = vm_get_victim ();
-	/* TODO: swap out the victim and return the evicted frame. */
+vm_evict_frame (long long *freed_cnt) {
+	struct frame *victims[EVICT_BATCH];
+	struct page *pages[EVICT_BATCH];
+	bool freed[EVICT_BATCH];
+	struct frame *frame = NULL;
+	size_t cnt;
+	bool evicted;
+
+	do {
+		cnt = 0;
+		lock_acquire (&frame_lock);
+		while (cnt < EVICT_BATCH) {
+			struct frame *victim = vm_get_victim ();
+
+			if (victim == NULL
+					|| (cnt > 0 && page_get_type (victim->page) != VM_ANON))
+				break;
+			victims[cnt] = victim;
+			pages[cnt] = victim->page;
+			victim->flags |= FRAME_LOCKED;
+			pml4_clear_page (pages[cnt]->owner->pml4, pages[cnt]->va);
+			if (page_get_type (pages[cnt++]) != VM_ANON)
+				break;
+		}
+		lock_release (&frame_lock);
+		if (cnt == 0)
+			return NULL;
+
+		if (page_get_type (pages[0]) == VM_ANON)
+			evicted = anon_swap_out_batch (pages, cnt);
+		else
+			evicted = swap_out (pages[0]);
 
-	return NULL;
+		lock_acquire (&frame_lock);
+		for (size_t i = 0; i < cnt; i++) {
+			victims[i]->flags &= ~FRAME_LOCKED;
+			freed[i] = evicted && frame_unlink (pages[i]);
+			if (!evicted)
+				map_page (pages[i]);
+			*freed_cnt += freed[i];
+		}
+		cond_broadcast (&frame_cond, &frame_lock);
+		lock_release (&frame_lock);
+
+		for (size_t i = 0; i < cnt; i++)
+			if (!freed[i])
+				continue;
+			else if (frame == NULL)
+				frame = victims[i];
+			else
+				palloc_free_page (victims[i]->kva);
+	} while (frame == NULL && evicted);
+	return frame;
+}
+
+/* The reclaim daemon.  Each time it is woken, it evicts frames in
+ * batches until reclaim_high_pages user frames are free, so that
+ * faults find a free frame without evicting one themselves. */
+static void
+kswapd (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&kswapd_sema);
+		kswapd_wakeups++;
+		while (palloc_free_cnt (PAL_USER) < reclaim_high_pages) {
+			struct frame *frame = vm_evict_frame (&kswapd_evict_cnt);
+
+			if (frame == NULL)
+				break;
+			palloc_free_page (frame->kva);
+		}
+		kswapd_awake = false;
+	}
+}
+
+static uint64_t
+ksm_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct ksm_item *item = hash_entry (e, struct ksm_item, elem);
+	return hash_bytes (&item->sum, sizeof item->sum);
+}
+
+static bool
+ksm_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct ksm_item, elem)->sum
+		< hash_entry (b, struct ksm_item, elem)->sum;
+}
+
+static void
+ksm_free_item (struct hash_elem *e, void *aux UNUSED) {
+	free (hash_entry (e, struct ksm_item, elem));
+}
+
+/* Returns true if FRAME holds anonymous pages that nothing is
+ * using right now.  Program text is left to the text index.
+ * frame_lock must be held. */
+static bool
+ksm_candidate (struct frame *frame) {
+	struct page *page = frame->page;
+
+	return page != NULL && frame->pin_cnt == 0 && frame->flags == 0
+		&& frame->text == NULL
+		&& VM_TYPE (page->operations->type) == VM_ANON;
+}
+
+/* Write-protects every page sharing FRAME, keeping their dirty
+ * bits. */
+static void
+ksm_protect (struct frame *frame) {
+	for (struct page *p = frame->page; p != NULL; p = p->next_sharer)
+		pml4_protect_range (p->owner->pml4, p->va, p->va + PGSIZE, false);
+}
+
+/* Moves the pages of frame B to frame A, if both hold the same
+ * bytes, and frees B.  A may be the zero frame.  Returns true if
+ * it did.  frame_lock must be held. */
+static bool
+ksm_merge (struct frame *a, struct frame *b) {
+	if (memcmp (a->kva, b->kva, PGSIZE))
+		return false;
+
+	/* A user process may write either frame until it is
+	 * write-protected, so compare again after that. */
+	ksm_protect (a);
+	ksm_protect (b);
+	if (memcmp (a->kva, b->kva, PGSIZE))
+		return false;
+
+	while (b->page != NULL) {
+		struct page *p = b->page;
+		/* map_page() clears the dirty bit, which tells whether the
+		 * page's swap slot is stale. */
+		bool dirty = pml4_is_dirty (p->owner->pml4, p->va);
+
+		frame_unlink (p);
+		frame_link (a, p);
+		/* The page table entry is only replaced, so this cannot
+		 * run out of memory. */
+		map_page (p);
+		if (dirty)
+			pml4_set_dirty (p->owner->pml4, p->va, true);
+		ksm_merge_cnt++;
+		if (a == zero_frame)
+			ksm_zero_cnt++;
+	}
+	palloc_free_page (b->kva);
+	return true;
+}
+
+/* Checksums frame IDX of mem_map[] and, if it did not change since
+ * the last pass, merges it with a frame seen in this pass with the
+ * same contents, or else records it.  Returns false if the frame
+ * was not a candidate. */
+static bool
+ksm_scan_frame (size_t idx) {
+	struct frame *frame = &mem_map[idx];
+	struct ksm_item *item;
+	struct hash_elem *e;
+	uint32_t sum;
+	bool stable;
+
+	lock_acquire (&frame_lock);
+	if (!ksm_candidate (frame)) {
+		lock_release (&frame_lock);
+		return false;
+	}
+	lock_release (&frame_lock);
+
+	/* The frame may be freed meanwhile, which only makes for a
+	 * useless checksum: nothing is merged without comparing the
+	 * contents under frame_lock. */
+	sum = hash_bytes (frame->kva, PGSIZE);
+	stable = ksm_sums[idx] == sum;
+	ksm_sums[idx] = sum;
+	ksm_scan_cnt++;
+	if (!stable)
+		return true;
+
+	item = malloc (sizeof *item);
+	if (item == NULL)
+		return true;
+	item->sum = sum;
+	item->frame = frame;
+
+	lock_acquire (&frame_lock);
+	if (ksm_candidate (frame)
+			&& !(sum == ksm_zero_sum && ksm_merge (zero_frame, frame))) {
+		e = hash_insert (&ksm_seen, &item->elem);
+		if (e == NULL)
+			item = NULL;
+		else {
+			struct ksm_item *old = hash_entry (e, struct ksm_item, elem);
+
+			/* Keep the newer frame if the older one did not match. */
+			if (!ksm_candidate (old->frame) || !ksm_merge (old->frame, frame))
+				old->frame = frame;
+		}
+	}
+	lock_release (&frame_lock);
+	free (item);
+	return true;
+}
+
+/* The page merging daemon.  KSM_HZ times a second, it checksums
+ * the next ksm_pages_per_sec / KSM_HZ candidate frames. */
+static void
+ksmd (void *aux UNUSED) {
+	size_t cursor = 0;
+	size_t batch = ksm_pages_per_sec / KSM_HZ > 0
+		? ksm_pages_per_sec / KSM_HZ : 1;
+
+	for (;;) {
+		int64_t start = timer_ticks ();
+
+		for (size_t n = 0; n < batch; ) {
+			n += ksm_scan_frame (cursor);
+			if (++cursor == mem_map_cnt) {
+				cursor = 0;
+				hash_clear (&ksm_seen, ksm_free_item);
+				ksm_pass_cnt++;
+				break;
+			}
+		}
+		ksm_ticks += timer_elapsed (start);
+		timer_msleep (1000 / KSM_HZ);
+	}
+}
+
+/* Moves the run of HUGE_PGCNT pages that starts with FIRST to a
+ * 2 MB frame, if each is a resident anonymous page of the same
+ * process, alone on a frame that is not in use, and mapped with
+ * the same permission.  The other pages are found through the
+ * owner's page table, which is safe under frame_lock: the owner
+ * unlinks its pages before it destroys the page table.  Returns
+ * true if the run was collapsed.  frame_lock must be held. */
+static bool
+collapse_huge (struct page *first) {
+	static struct page *run[HUGE_PGCNT];
+	uint64_t *pml4 = first->owner->pml4;
+	uint8_t *base = first->va;
+	uint8_t *kpage;
+
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (base + HUGE_PGSIZE > (uint8_t *) KERN_BASE)
+		return false;
+	for (size_t i = 0; i < HUGE_PGCNT; i++) {
+		void *kva = pml4_get_page (pml4, base + i * PGSIZE);
+		struct frame *frame;
+		struct page *page;
+
+		if (kva == NULL)
+			return false;
+		frame = frame_of (kva);
+		page = frame->page;
+		if (page == NULL || page->owner != first->owner
+				|| page->va != base + i * PGSIZE
+				|| page->writable != first->writable
+				|| VM_TYPE (page->operations->type) != VM_ANON
+				|| frame->ref_cnt != 1 || frame->pin_cnt > 0
+				|| frame->flags != 0 || frame->text != NULL)
+			return false;
+		run[i] = page;
+	}
+
+	kpage = palloc_get_huge_page (PAL_USER);
+	if (kpage == NULL)
+		return false;
+
+	/* Keep the owner from writing the old frames while they are
+	 * copied.  A write faults into vm_handle_wp(), which waits for
+	 * frame_lock and finds the new mapping. */
+	pml4_protect_range (pml4, base, base + HUGE_PGSIZE, false);
+	for (size_t i = 0; i < HUGE_PGCNT; i++)
+		memcpy (kpage + i * PGSIZE, run[i]->frame->kva, PGSIZE);
+	if (!pml4_collapse_huge_page (pml4, base, kpage, first->writable))
+		PANIC ("collapse_huge: no page table for a mapped run");
+
+	/* Free the old frames only now that nothing maps them. */
+	for (size_t i = 0; i < HUGE_PGCNT; i++) {
+		struct frame *old = run[i]->frame;
+		struct frame *new = frame_of (kpage + i * PGSIZE);
+
+		frame_unlink (run[i]);
+		palloc_free_page (old->kva);
+		frame_link (new, run[i]);
+		new->flags |= FRAME_HUGE;
+	}
+	thp_collapse_cnt++;
+	return true;
+}
+
+/* Returns the working set of T as of the last complete pass.
+ * frame_lock must be held. */
+static size_t
+ws_last (struct thread *t) {
+	if (t->ws_epoch == ws_epoch)
+		return t->wss;
+	return t->ws_epoch + 1 == ws_epoch ? t->ws_cur : 0;
+}
+
+/* Counts an access to a page of T in the current pass, and closes
+ * T's count of an earlier pass if this is the first one since.
+ * frame_lock must be held. */
+static void
+ws_note (struct thread *t) {
+	if (t->ws_epoch != ws_epoch) {
+		t->wss = ws_last (t);
+		if (t->ws_cur > t->wss_peak)
+			t->wss_peak = t->ws_cur;
+		t->ws_cur = 0;
+		t->ws_epoch = ws_epoch;
+	}
+	t->ws_cur++;
+}
+
+/* Counts the pages on FRAME that were accessed since the last pass,
+ * and marks them referenced.  The pages of a 2 MB frame share one
+ * accessed bit, which is cleared at its last frame.  frame_lock
+ * must be held. */
+static void
+ws_sample_frame (struct frame *frame) {
+	bool clear = !(frame->flags & FRAME_HUGE)
+		|| frame == huge_head (frame) + HUGE_PGCNT - 1;
+
+	for (struct page *p = frame->page; p != NULL; p = p->next_sharer)
+		if (pml4_is_accessed (p->owner->pml4, p->va)) {
+			if (clear)
+				pml4_set_accessed (p->owner->pml4, p->va, false);
+			p->referenced = true;
+			ws_note (p->owner);
+		}
+}
+
+/* The working set sampler. */
+static void
+ws_sampler (void *aux UNUSED) {
+	for (;;) {
+		timer_msleep (ws_sample_ms);
+		for (size_t i = 0; i < mem_map_cnt; i++) {
+			struct frame *frame = &mem_map[i];
+
+			lock_acquire (&frame_lock);
+			if (frame->page != NULL && !(frame->flags & FRAME_LOCKED))
+				ws_sample_frame (frame);
+			lock_release (&frame_lock);
+		}
+		lock_acquire (&frame_lock);
+		ws_epoch++;
+		lock_release (&frame_lock);
+	}
+}
+
+/* Prints the resident set and working set of T, a process that is
+ * exiting, if either is being watched. */
+void
+vm_print_rss (struct thread *t) {
+	size_t rss, rss_peak, wss, wss_peak;
+
+	if (t->pml4 == NULL || (ws_sample_ms == 0 && rss_soft_limit == 0))
+		return;
+	lock_acquire (&frame_lock);
+	rss = t->rss;
+	rss_peak = t->rss_peak;
+	wss = ws_last (t);
+	wss_peak = t->wss_peak > wss ? t->wss_peak : wss;
+	lock_release (&frame_lock);
+
+	printf ("%s: rss %zu pages, peak %zu", t->name, rss, rss_peak);
+	if (ws_sample_ms > 0)
+		printf ("; working set %zu pages, peak %zu", wss, wss_peak);
+	printf ("\n");
+}
+
+/* The huge page daemon.  Every THP_SCAN_MS, it walks mem_map[] for
+ * anonymous pages at a 2 MB boundary, and tries to collapse the run
+ * each one starts. */
+static void
+khugepaged (void *aux UNUSED) {
+	for (;;) {
+		size_t collapsed = 0;
+
+		timer_msleep (THP_SCAN_MS);
+		for (size_t i = 0; i < mem_map_cnt && collapsed < THP_COLLAPSE_MAX;
+				i++) {
+			struct frame *frame = &mem_map[i];
+			struct page *page;
+
+			lock_acquire (&frame_lock);
+			page = frame->page;
+			if (page != NULL && frame->flags == 0
+					&& (uint64_t) page->va % HUGE_PGSIZE == 0
+					&& VM_TYPE (page->operations->type) == VM_ANON
+					&& collapse_huge (page))
+				collapsed++;
+			lock_release (&frame_lock);
+		}
+	}
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
- * and return it. This always return valid address. That is, if the user pool
- * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * and return it.  Returns a null pointer if nothing can be evicted
+ * either, because swap is full or every frame is pinned or in use
+ * by the kernel; the fault that needed the frame then fails.
+ *
+ * Evicting here is the slow path, which the reclaim daemon tries to
+ * keep faults off; it is woken as soon as free frames run low. */
 static struct frame *
 vm_get_frame (void) {
 	struct frame *frame = NULL;
-	/* TODO: Fill this function. */
+	void *kva = palloc_get_page (PAL_USER);
+
+	frame_alloc_cnt++;
+	if (kva != NULL)
+		frame = frame_of (kva);
+	else {
+		direct_reclaim_cnt++;
+		frame = vm_evict_frame (&direct_evict_cnt);
+	}
+
+	if (!kswapd_awake && reclaim_low_pages > 0
+			&& palloc_free_cnt (PAL_USER) < reclaim_low_pages) {
+		kswapd_awake = true;
+		sema_up (&kswapd_sema);
+	}
 
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+	ASSERT (frame == NULL || frame->page == NULL);
 	return frame;
 }
 
+/* Waits, with frame_lock held, until PAGE's frame is not being
+ * evicted.  Returns the frame, or NULL if PAGE is not resident. */
+static struct frame *
+wait_for_frame (struct page *page) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	while (page->frame != NULL && (page->frame->flags & FRAME_LOCKED))
+		cond_wait (&frame_cond, &frame_lock);
+	return page->frame;
+}
+
+/* Unmaps PAGE and gives its frame back, if it has one and no other
+ * page shares it.  Called by the destroy handlers of each page
+ * type. */
+void
+vm_free_frame (struct page *page) {
+	struct frame *frame;
+
+	lock_acquire (&frame_lock);
+	frame = wait_for_frame (page);
+	if (frame != NULL) {
+		if ((frame->flags & FRAME_HUGE) && !split_huge (frame)) {
+			/* Pages are only freed one at a time when the whole
+			 * address space goes, so the rest of the 2 MB page may
+			 * as well be unmapped with it. */
+			struct frame *head = huge_head (frame);
+
+			pml4_clear_page (page->owner->pml4, head->page->va);
+			for (size_t i = 0; i < HUGE_PGCNT; i++)
+				head[i].flags &= ~FRAME_HUGE;
+		}
+		if (page->owner->pml4 != NULL)
+			pml4_clear_page (page->owner->pml4, page->va);
+		if (frame_unlink (page))
+			palloc_free_page (frame->kva);
+	}
+	lock_release (&frame_lock);
+}
+
+/* Keeps PAGE's frame from being evicted until vm_unpin_page().
+ * Returns false, pinning nothing, if PAGE is not resident. */
+bool
+vm_pin_page (struct page *page) {
+	struct frame *frame;
+
+	lock_acquire (&frame_lock);
+	frame = wait_for_frame (page);
+	if (frame != NULL)
+		frame->pin_cnt++;
+	lock_release (&frame_lock);
+	return frame != NULL;
+}
+
+/* Returns true if PAGE is resident and its frame is neither
+ * pinned nor in transit, so that nothing is using its backing
+ * store right now. */
+bool
+vm_page_is_idle (struct page *page) {
+	bool idle;
+
+	lock_acquire (&frame_lock);
+	idle = page->frame != NULL && page->frame->pin_cnt == 0
+		&& page->frame->flags == 0;
+	lock_release (&frame_lock);
+	return idle;
+}
+
+/* Lets PAGE's frame be evicted again. */
+void
+vm_unpin_page (struct page *page) {
+	lock_acquire (&frame_lock);
+	if (page->frame != NULL) {
+		ASSERT (page->frame->pin_cnt > 0);
+		page->frame->pin_cnt--;
+	}
+	lock_release (&frame_lock);
+}
+
 /* Growing the stack. */
 static void
-vm_stack_growth (void *addr UNUSED) {
+vm_stack_growth (void *addr) {
+	vm_alloc_page (VM_ANON | VM_MARKER_0, pg_round_down (addr), true);
+}
+
+/* Returns true if a fault at ADDR with the stack pointer at RSP
+ * looks like a push or a access just below the stack. */
+static bool
+is_stack_access (void *addr, uint64_t rsp) {
+	uint64_t va = (uint64_t) addr;
+
+	return va >= rsp - 8 && va < USER_STACK && va >= USER_STACK - STACK_LIMIT;
+}
+
+/* Handle the fault on write_protected page.
+ *
+ * PAGE is writable, but mapped read-only because it shares its
+ * frame.  If it has meanwhile become the only page there, it is
+ * just made writable.  Otherwise it gets a copy of the frame to
+ * itself, and the others keep the original. */
+static bool
+vm_handle_wp (struct page *page) {
+	struct frame *old, *new;
+
+	lock_acquire (&frame_lock);
+	old = wait_for_frame (page);
+	if (old == NULL || old->ref_cnt == 1 || (old->flags & FRAME_CACHE)) {
+		/* If the page was evicted instead, the access that faulted
+		 * will fault again and bring it back.  A page that was
+		 * moved to a 2 MB frame meanwhile is writable already.  A
+		 * page of the page cache is written in place, never copied:
+		 * every mapping of it has to see the write. */
+		if (old != NULL && !(old->flags & FRAME_HUGE)) {
+			pml4_protect_range (page->owner->pml4, page->va,
+					page->va + PGSIZE, true);
+			if (!(old->flags & FRAME_CACHE))
+				cow_reuse_cnt++;
+		}
+		lock_release (&frame_lock);
+		return true;
+	}
+	old->pin_cnt++;
+	lock_release (&frame_lock);
+
+	new = vm_get_frame ();
+	if (new == NULL) {
+		lock_acquire (&frame_lock);
+		old->pin_cnt--;
+		lock_release (&frame_lock);
+		return false;
+	}
+	if (old == zero_frame)
+		memset (new->kva, 0, PGSIZE);
+	else
+		memcpy (new->kva, old->kva, PGSIZE);
+
+	lock_acquire (&frame_lock);
+	old->pin_cnt--;
+	pml4_clear_page (page->owner->pml4, page->va);
+	if (frame_unlink (page))
+		palloc_free_page (old->kva);
+	frame_link (new, page);
+	cow_copy_cnt++;
+	if (!map_page (page)) {
+		frame_unlink (page);
+		palloc_free_page (new->kva);
+		lock_release (&frame_lock);
+		return false;
+	}
+	lock_release (&frame_lock);
+	return true;
+}
+
+/* Returns true if PAGE is an anonymous page that has not been
+ * touched yet and has nothing to load, like bss or stack. */
+static bool
+is_zero_fill (struct page *page) {
+	return VM_TYPE (page->operations->type) == VM_UNINIT
+		&& VM_TYPE (page->uninit.type) == VM_ANON
+		&& page->uninit.init == NULL;
+}
+
+/* Maps PAGE, which is_zero_fill(), to the zero frame. */
+static bool
+map_zero_page (struct page *page) {
+	bool mapped;
+
+	if (!swap_in (page, NULL))
+		return false;
+
+	lock_acquire (&frame_lock);
+	frame_link (zero_frame, page);
+	mapped = map_page (page);
+	if (!mapped)
+		frame_unlink (page);
+	lock_release (&frame_lock);
+	if (mapped)
+		zero_map_cnt++;
+	return mapped;
+}
+
+/* Where a page of program text is loaded from. */
+struct text_pos {
+	struct inode *inode;    /* The executable. */
+	off_t ofs;              /* Offset of the page in it. */
+	size_t read_bytes;      /* Bytes from the file; the rest is zero. */
+	void *va;               /* Address of the page. */
+};
+
+/* If PAGE is a page of a read-only segment of the executable that
+ * has not been loaded yet, stores its position in POS and returns
+ * true. */
+static bool
+lazy_text_pos (struct page *page, struct text_pos *pos) {
+	struct file_page *info;
+
+	if (VM_TYPE (page->operations->type) != VM_UNINIT
+			|| VM_TYPE (page->uninit.type) != VM_ANON
+			|| page->uninit.init == NULL || page->writable)
+		return false;
+	info = page->uninit.aux;
+	if (info == NULL)
+		return false;
+	pos->inode = file_get_inode (info->file);
+	pos->ofs = info->ofs;
+	pos->read_bytes = info->read_bytes;
+	pos->va = page->va;
+	return true;
+}
+
+static uint64_t
+text_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct text_frame *t = hash_entry (e, struct text_frame, elem);
+	uint64_t key[] = { (uint64_t) t->inode, t->ofs };
+
+	return hash_bytes (key, sizeof key);
+}
+
+static bool
+text_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct text_frame *a = hash_entry (a_, struct text_frame, elem);
+	const struct text_frame *b = hash_entry (b_, struct text_frame, elem);
+
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	if (a->ofs != b->ofs)
+		return a->ofs < b->ofs;
+	return a->read_bytes < b->read_bytes;
+}
+
+static uint64_t
+text_file_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct text_file *f = hash_entry (e, struct text_file, elem);
+
+	return hash_bytes (&f->inode, sizeof f->inode);
+}
+
+static bool
+text_file_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct text_file, elem)->inode
+		< hash_entry (b, struct text_file, elem)->inode;
+}
+
+/* Takes T out of the text index and detaches it from its frame.
+ * Its inode is closed later, by text_reap().  frame_lock must be
+ * held. */
+static void
+text_drop (struct text_frame *t) {
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	hash_delete (&text_index, &t->elem);
+	list_remove (&t->file_elem);
+	if (list_empty (&t->file->frames)) {
+		hash_delete (&text_files, &t->file->elem);
+		free (t->file);
+	}
+	t->frame->text = NULL;
+	list_push_back (&text_dead, &t->file_elem);
+}
+
+/* Closes the inodes of the entries dropped from the text index.
+ * Must be called without frame_lock. */
+static void
+text_reap (void) {
+	struct list dead;
+	bool locked;
+
+	list_init (&dead);
+	lock_acquire (&frame_lock);
+	while (!list_empty (&text_dead))
+		list_push_back (&dead, list_pop_front (&text_dead));
+	lock_release (&frame_lock);
+	if (list_empty (&dead))
+		return;
+
+	locked = vm_lock_filesys ();
+	while (!list_empty (&dead)) {
+		struct text_frame *t = list_entry (list_pop_front (&dead),
+				struct text_frame, file_elem);
+		inode_close (t->inode);
+		free (t);
+	}
+	vm_unlock_filesys (locked);
+}
+
+/* Drops every text index entry of INODE, which is about to be
+ * written to or has been removed, so that no process maps the old
+ * contents from now on.  Pages that map them already keep them. */
+void
+vm_text_forget (struct inode *inode) {
+	struct text_file key = { .inode = inode };
+	struct hash_elem *e;
+
+	if (hash_empty (&text_files))
+		return;
+	lock_acquire (&frame_lock);
+	/* The last drop frees the inode's entry in text_files. */
+	while ((e = hash_find (&text_files, &key.elem)) != NULL) {
+		struct text_file *f = hash_entry (e, struct text_file, elem);
+
+		text_drop (list_entry (list_front (&f->frames),
+					struct text_frame, file_elem));
+	}
+	lock_release (&frame_lock);
+}
+
+/* Maps PAGE, a page of program text at POS, to a frame that
+ * already holds the same text, if the index has one.  PAGE becomes
+ * the anonymous page it would be after loading, without reading
+ * anything. */
+static bool
+map_text_page (struct page *page, struct text_pos *pos) {
+	struct text_frame key = { .inode = pos->inode,
+		.ofs = pos->ofs, .read_bytes = pos->read_bytes };
+	struct file_page *info = page->uninit.aux;
+	struct hash_elem *e;
+	struct frame *frame;
+	bool mapped, locked;
+
+	lock_acquire (&frame_lock);
+	while ((e = hash_find (&text_index, &key.elem)) != NULL) {
+		frame = hash_entry (e, struct text_frame, elem)->frame;
+		if (!(frame->flags & FRAME_LOCKED))
+			break;
+		cond_wait (&frame_cond, &frame_lock);
+	}
+	if (e == NULL) {
+		lock_release (&frame_lock);
+		return false;
+	}
+	frame_link (frame, page);
+	mapped = map_page (page);
+	if (!mapped)
+		frame_unlink (page);
+	else
+		frame->pin_cnt++;
+	lock_release (&frame_lock);
+	if (!mapped)
+		return false;
+
+	/* Nobody else looks at PAGE until this returns, but the frame
+	 * is kept from eviction, which does. */
+	page->uninit.page_initializer (page, page->uninit.type, NULL);
+	locked = vm_lock_filesys ();
+	file_close (info->file);
+	vm_unlock_filesys (locked);
+	free (info);
+	vm_unpin_page (page);
+	text_share_cnt++;
+	return true;
+}
+
+/* Adds the frame of PAGE, a page of program text at POS that was
+ * just loaded, to the text index, unless the same text is there. */
+static void
+index_text_page (struct page *page, struct text_pos *pos) {
+	struct text_frame *t = malloc (sizeof *t);
+	struct text_file *f = malloc (sizeof *f);
+	struct text_file *file;
+	struct hash_elem *e;
+	bool locked;
+
+	if (t == NULL || f == NULL) {
+		free (t);
+		free (f);
+		return;
+	}
+	locked = vm_lock_filesys ();
+	t->inode = inode_reopen (pos->inode);
+	vm_unlock_filesys (locked);
+	t->ofs = pos->ofs;
+	t->read_bytes = pos->read_bytes;
+	f->inode = pos->inode;
+	list_init (&f->frames);
+
+	lock_acquire (&frame_lock);
+	if (page->frame != NULL && page->frame->text == NULL
+			&& hash_insert (&text_index, &t->elem) == NULL) {
+		e = hash_insert (&text_files, &f->elem);
+		file = e != NULL ? hash_entry (e, struct text_file, elem) : f;
+		if (file == f)
+			f = NULL;
+		t->frame = page->frame;
+		t->file = file;
+		list_push_back (&file->frames, &t->file_elem);
+		page->frame->text = t;
+		t = NULL;
+	}
+	lock_release (&frame_lock);
+	free (f);
+	if (t != NULL) {
+		locked = vm_lock_filesys ();
+		inode_close (t->inode);
+		vm_unlock_filesys (locked);
+		free (t);
+	}
+}
+
+/* Claims PAGE, a page of program text at POS, sharing the frame of
+ * another process that runs the same executable if possible.  If
+ * SPECULATIVE, only a free frame is used for loading. */
+static bool
+claim_text_page (struct page *page, struct text_pos *pos, bool speculative) {
+	struct frame *frame;
+
+	text_reap ();
+	if (map_text_page (page, pos))
+		return true;
+
+	if (!speculative)
+		frame = vm_get_frame ();
+	else {
+		void *kva = palloc_get_page (PAL_USER);
+		if (kva == NULL)
+			return false;
+		frame = frame_of (kva);
+	}
+	if (!install_frame (page, frame))
+		return false;
+	index_text_page (page, pos);
+	return true;
+}
+
+/* Maps PAGE, a page of an mmap region that is not resident, to the
+ * page cache's copy of the same page of the file, so that the file
+ * is in memory once however many processes read or map it.  Every
+ * mapper writes to that one frame, so no write is lost to a private
+ * copy.  The page is written back through the cache as before,
+ * which then copies it onto itself.  Only whole, page-aligned
+ * pages of the file are shared.  Returns false if PAGE needs a
+ * frame of its own instead. */
+static bool
+map_cache_page (struct page *page) {
+	bool lazy = VM_TYPE (page->operations->type) == VM_UNINIT;
+	struct file_page *info;
+	struct frame *frame;
+	bool mapped, locked;
+	void *kva;
+
+	if (page_get_type (page) != VM_FILE)
+		return false;
+	info = lazy ? page->uninit.aux : &page->file;
+	if (info == NULL || info->read_bytes != PGSIZE || info->ofs % PGSIZE != 0)
+		return false;
+
+	locked = vm_lock_filesys ();
+	kva = inode_share_page (file_get_inode (info->file), info->ofs / PGSIZE);
+	vm_unlock_filesys (locked);
+	if (kva == NULL)
+		return false;
+
+	frame = frame_of (kva);
+	lock_acquire (&frame_lock);
+	frame_link (frame, page);
+	mapped = map_page (page);
+	if (!mapped)
+		frame_unlink (page);
+	lock_release (&frame_lock);
+	page_cache_put (kva, 0, 0);
+	if (!mapped)
+		return false;
+
+	/* As in map_text_page(), the frame is pinned, so nobody looks
+	 * at PAGE meanwhile. */
+	if (lazy) {
+		struct file_page file = *info;
+
+		page->uninit.page_initializer (page, page->uninit.type, NULL);
+		page->file = file;
+		free (info);
+	}
+	cache_map_cnt++;
+	return true;
+}
+
+/* Brings in PAGE if it lies in the same segment as the faulting
+ * page at AUX, that is, at the same distance from it in the file
+ * as in memory.  Speculative, so only a free frame is used.  Stops
+ * the walk when that fails. */
+static bool
+fault_around_page (struct page *page, void *aux) {
+	struct text_pos *fault = aux;
+	struct text_pos pos;
+
+	if (!lazy_text_pos (page, &pos) || pos.inode != fault->inode
+			|| (int64_t) pos.ofs - fault->ofs
+			!= (uint8_t *) pos.va - (uint8_t *) fault->va)
+		return true;
+	if (!claim_text_page (page, &pos, true))
+		return false;
+	fault_around_cnt++;
+	return true;
+}
+
+/* Loads the text pages in the aligned window of fault_around_pages
+ * pages around FAULT, a fault on program text that was just
+ * handled.  Code is mostly run front to back, so this saves a trap
+ * per page when a program starts. */
+static void
+fault_around (struct text_pos *fault) {
+	size_t n = fault_around_pages;
+	uint8_t *start = (uint8_t *) fault->va - pg_no (fault->va) % n * PGSIZE;
+
+	spt_for_each (&thread_current ()->spt, start, start + n * PGSIZE,
+			fault_around_page, fault);
+}
+
+/* Loads PAGE, unless it is resident, into a frame that is free
+ * right now, never evicting for it.  Returns false if there is no
+ * free frame or the page could not be loaded. */
+static bool
+prefetch_page (struct page *page) {
+	struct text_pos pos;
+	void *kva;
+
+	if (page->frame != NULL)
+		return true;
+	if (lazy_text_pos (page, &pos))
+		return claim_text_page (page, &pos, true);
+	kva = palloc_get_page (PAL_USER);
+	return kva != NULL && install_frame (page, frame_of (kva));
+}
+
+/* Evicts PAGE now, if it is resident and its frame is neither
+ * pinned nor in transit, writing it out first if needed.  If
+ * ONLY_CLEAN, a page that would need writing is left in place,
+ * but with its accessed bit cleared so that the clock hand takes
+ * it soon. */
+static void
+page_out (struct page *page, bool only_clean) {
+	struct frame *frame;
+	bool evicted, freed;
+
+	lock_acquire (&frame_lock);
+	frame = wait_for_frame (page);
+	if (frame == NULL || frame->pin_cnt > 0
+			|| ((frame->flags & FRAME_HUGE) && !split_huge (frame))) {
+		lock_release (&frame_lock);
+		return;
+	}
+	if (only_clean && !page_is_clean (page)) {
+		pml4_set_accessed (page->owner->pml4, page->va, false);
+		page->referenced = false;
+		lock_release (&frame_lock);
+		return;
+	}
+	frame->flags |= FRAME_LOCKED;
+	pml4_clear_page (page->owner->pml4, page->va);
+	lock_release (&frame_lock);
+
+	if (page_get_type (page) == VM_ANON)
+		evicted = anon_swap_out_batch (&page, 1);
+	else
+		evicted = swap_out (page);
+
+	lock_acquire (&frame_lock);
+	frame->flags &= ~FRAME_LOCKED;
+	freed = evicted && frame_unlink (page);
+	if (!evicted)
+		map_page (page);
+	cond_broadcast (&frame_cond, &frame_lock);
+	lock_release (&frame_lock);
+	if (freed)
+		palloc_free_page (frame->kva);
+}
+
+static bool
+read_ahead_page (struct page *page, void *aux UNUSED) {
+	if (!page->sequential)
+		return true;
+	if (page->frame == NULL) {
+		if (!prefetch_page (page))
+			return false;
+		seq_readahead_cnt++;
+	}
+	return true;
 }
 
-/* Handle the fault on write_protected page */
 static bool
-vm_handle_wp (struct page *page UNUSED) {
+drop_behind_page (struct page *page, void *aux UNUSED) {
+	if (page->sequential && page->frame != NULL) {
+		page_out (page, true);
+		seq_drop_cnt += page->frame == NULL;
+	}
+	return true;
+}
+
+/* Handles the rest of a fault on PAGE, which is in a range under
+ * MADV_SEQUENTIAL: the SEQ_WINDOW pages after it are read ahead
+ * into free frames, and the window of pages before the previous
+ * one is dropped, as far as that needs no I/O. */
+static void
+sequential_fault (struct page *page) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *va = page->va;
+
+	spt_for_each (spt, va + PGSIZE, va + (SEQ_WINDOW + 1) * PGSIZE,
+			read_ahead_page, NULL);
+	if ((uintptr_t) va >= 2 * SEQ_WINDOW * PGSIZE)
+		spt_for_each (spt, va - 2 * SEQ_WINDOW * PGSIZE,
+				va - SEQ_WINDOW * PGSIZE, drop_behind_page, NULL);
 }
 
 /* Return true on success */
 bool
-vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
-		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
-	struct supplemental_page_table *spt UNUSED = &thread_current ()->spt;
+vm_try_handle_fault (struct intr_frame *f, void *addr,
+		bool user, bool write, bool not_present) {
+	struct thread *t = thread_current ();
+	struct supplemental_page_table *spt = &t->spt;
 	struct page *page = NULL;
-	/* TODO: Validate the fault */
-	/* TODO: Your code goes here */
 
-	return vm_do_claim_page (page);
+	if (addr == NULL || !is_user_vaddr (addr))
+		return false;
+
+	page = spt_find_page (spt, addr);
+	if (page == NULL) {
+		/* A fault taken inside a system call sees the kernel's rsp,
+		 * so use the user one saved on entry instead. */
+		uint64_t rsp = user ? f->rsp : t->user_rsp;
+
+		if (!is_stack_access (addr, rsp))
+			return false;
+		vm_stack_growth (addr);
+		page = spt_find_page (spt, addr);
+		if (page == NULL)
+			return false;
+	}
+
+	if (!not_present)
+		return write && page->writable && vm_handle_wp (page);
+	if (write && !page->writable)
+		return false;
+	if (!write && is_zero_fill (page))
+		return map_zero_page (page);
+
+	/* Swapped-out pages of this process that follow this one on
+	 * disk are likely to be wanted soon.  Read them in as well, but
+	 * only into frames that are free right now. */
+	struct page *ahead[SWAP_READAHEAD];
+	size_t ahead_cnt = anon_swap_neighbors (page, ahead, SWAP_READAHEAD);
+
+	/* Take note now whether this is program text; loading the page
+	 * gives up where it came from. */
+	struct text_pos text;
+	bool around = fault_around_pages > 1 && lazy_text_pos (page, &text);
+
+	if (!vm_do_claim_page (page))
+		return false;
+	if (around)
+		fault_around (&text);
+	if (page->sequential)
+		sequential_fault (page);
+	for (size_t i = 0; i < ahead_cnt; i++) {
+		void *kva;
+
+		if (ahead[i]->frame != NULL
+				|| (kva = palloc_get_page (PAL_USER)) == NULL)
+			break;
+		if (install_frame (ahead[i], frame_of (kva)))
+			swap_readahead_cnt++;
+	}
+	return true;
 }
 
 /* Free the page.
@@ -150,41 +1728,412 @@ vm_dealloc_page (struct page *page) {
 
 /* Claim the page that allocate on VA. */
 bool
-vm_claim_page (void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function */
+vm_claim_page (void *va) {
+	struct page *page = spt_find_page (&thread_current ()->spt, va);
 
+	if (page == NULL)
+		return false;
 	return vm_do_claim_page (page);
 }
 
 /* Claim the PAGE and set up the mmu. */
 static bool
 vm_do_claim_page (struct page *page) {
-	struct frame *frame = vm_get_frame ();
+	struct frame *frame;
+	struct text_pos pos;
 
-	/* Set links */
-	frame->page = page;
-	page->frame = frame;
+	/* The page may still be on its way out; if writing it failed,
+	 * it is mapped again and there is nothing to do. */
+	lock_acquire (&frame_lock);
+	frame = wait_for_frame (page);
+	lock_release (&frame_lock);
+	if (frame != NULL)
+		return true;
+
+	if (lazy_text_pos (page, &pos))
+		return claim_text_page (page, &pos, false);
+	if (map_cache_page (page))
+		return true;
+	return install_frame (page, vm_get_frame ());
+}
+
+/* Backs PAGE, which is not resident, with FRAME and loads it.
+ * Frees FRAME and returns false if that fails, or if FRAME is a
+ * null pointer because no frame could be had. */
+static bool
+install_frame (struct page *page, struct frame *frame) {
+	bool mapped;
+
+	if (frame == NULL)
+		return false;
+
+	/* Set links.  The frame stays pinned until its contents are in. */
+	lock_acquire (&frame_lock);
+	frame_link (frame, page);
+	frame->pin_cnt = 1;
+	mapped = map_page (page);
+	lock_release (&frame_lock);
+
+	if (!mapped || !swap_in (page, frame->kva)) {
+		vm_free_frame (page);
+		return false;
+	}
+	vm_unpin_page (page);
+	return true;
+}
+
+/* Makes every page of the SIZE bytes at BUFFER resident and pins
+ * it, so that a system call can use the buffer while holding the
+ * file system lock without faulting.  The stack is grown into if
+ * needed.  Returns false, with nothing left pinned, if some page is
+ * not valid, not writable while WRITE is true, or cannot be given
+ * a frame. */
+bool
+vm_pin_buffer (void *buffer, size_t size, bool write) {
+	struct thread *t = thread_current ();
+	uint8_t *upage = pg_round_down (buffer);
+
+	for (; upage < (uint8_t *) buffer + size; upage += PGSIZE) {
+		struct page *page = spt_find_page (&t->spt, upage);
+
+		if (page == NULL) {
+			void *addr = upage < (uint8_t *) buffer ? buffer : upage;
+
+			if (!is_stack_access (addr, t->user_rsp))
+				goto fail;
+			vm_stack_growth (addr);
+			page = spt_find_page (&t->spt, upage);
+			if (page == NULL)
+				goto fail;
+		}
+		if (write && !page->writable)
+			goto fail;
+
+		/* The kernel writes through the user mapping, but would not
+		 * fault on a read-only one, so a shared frame is copied now,
+		 * before the write can reach the other pages.  The page
+		 * cache's frames are written in place instead. */
+		for (;;) {
+			if (!vm_pin_page (page)) {
+				if (!vm_do_claim_page (page))
+					goto fail;
+				continue;
+			}
+			if (!write || page->frame->ref_cnt == 1
+					|| (page->frame->flags & FRAME_CACHE))
+				break;
+			vm_unpin_page (page);
+			if (!vm_handle_wp (page))
+				goto fail;
+		}
+	}
+	return true;
+
+fail:
+	if (upage > (uint8_t *) buffer)
+		vm_unpin_buffer (buffer, upage - (uint8_t *) buffer);
+	return false;
+}
+
+/* Undoes vm_pin_buffer() on the same range. */
+void
+vm_unpin_buffer (void *buffer, size_t size) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *upage = pg_round_down (buffer);
+
+	for (; upage < (uint8_t *) buffer + size; upage += PGSIZE) {
+		struct page *page = spt_find_page (spt, upage);
+		if (page != NULL)
+			vm_unpin_page (page);
+	}
+}
+
+static bool
+advise_page (struct page *page, void *advice_) {
+	int advice = *(int *) advice_;
+
+	switch (advice) {
+		case MADV_NORMAL:
+		case MADV_SEQUENTIAL:
+			page->sequential = advice == MADV_SEQUENTIAL;
+			return true;
+		case MADV_WILLNEED:
+			/* Only a hint, so stop once frames run out rather than
+			 * evict for pages that are not wanted yet. */
+			return prefetch_page (page);
+		case MADV_POPULATE:
+			return vm_do_claim_page (page);
+		case MADV_DONTNEED:
+			page_out (page, false);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Applies ADVICE, one of MADV_* in <syscall-nr.h>, to the pages of
+ * the current process in [ADDR, ADDR + LENGTH).  Unmapped pages in
+ * the range are skipped.  Returns false if ADVICE is unknown or
+ * MADV_POPULATE could not load some page. */
+bool
+vm_madvise (void *addr, size_t length, int advice) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	bool ok;
+
+	if (advice < MADV_NORMAL || advice > MADV_DONTNEED)
+		return false;
+	ok = spt_for_each (spt, addr, (uint8_t *) addr + length, advise_page,
+			&advice);
+	return ok || advice == MADV_WILLNEED;
+}
+
+/* Acquires the file system lock for a page-in or write-back,
+ * unless the current thread already holds it because the fault
+ * came from inside a file system call.  Returns whether it was
+ * taken; pass that to vm_unlock_filesys(). */
+bool
+vm_lock_filesys (void) {
+	if (lock_held_by_current_thread (&filesys_lock))
+		return false;
+	lock_acquire (&filesys_lock);
+	return true;
+}
 
-	/* TODO: Insert page table entry to map page's VA to frame's PA. */
+/* Releases the file system lock if vm_lock_filesys() took it. */
+void
+vm_unlock_filesys (bool locked) {
+	if (locked)
+		lock_release (&filesys_lock);
+}
 
-	return swap_in (page, frame->kva);
+/* Prints virtual memory statistics. */
+void
+vm_print_stats (void) {
+	vm_anon_print_stats ();
+	vm_file_print_stats ();
+	printf ("VM: %lld pages read ahead from swap, %lld loaded around "
+			"faults\n", swap_readahead_cnt, fault_around_cnt);
+	printf ("VM: %lld pages shared by fork in %lld ticks, "
+			"%lld copied on write, %lld reused in place\n",
+			cow_share_cnt, fork_ticks, cow_copy_cnt, cow_reuse_cnt);
+	printf ("VM: %lld pages read ahead and %lld dropped behind under "
+			"MADV_SEQUENTIAL\n", seq_readahead_cnt, seq_drop_cnt);
+	printf ("VM: %lld read faults served by the zero page\n", zero_map_cnt);
+	printf ("VM: %lld text pages shared between processes\n", text_share_cnt);
+	printf ("VM: %lld mmap pages mapped from the page cache\n", cache_map_cnt);
+	printf ("VM: kswapd woke %lld times and freed %lld frames; "
+			"%lld of %lld frame allocations reclaimed directly, "
+			"freeing %lld\n", kswapd_wakeups, kswapd_evict_cnt,
+			direct_reclaim_cnt, frame_alloc_cnt, direct_evict_cnt);
+	if (user_huge_pages)
+		printf ("VM: %lld 2 MB pages collapsed, %lld split\n",
+				thp_collapse_cnt, thp_split_cnt);
+	if (rss_soft_limit > 0)
+		printf ("VM: %lld victims taken from processes over %zu pages\n",
+				rss_limit_evict_cnt, rss_soft_limit);
+	if (ksm_pages_per_sec > 0)
+		printf ("VM: ksmd scanned %lld frames in %lld ticks over %lld passes, "
+				"merged %lld pages, %lld into the zero page\n", ksm_scan_cnt,
+				ksm_ticks, ksm_pass_cnt, ksm_merge_cnt, ksm_zero_cnt);
 }
 
 /* Initialize new supplemental page table */
 void
-supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
+supplemental_page_table_init (struct supplemental_page_table *spt) {
+	spt->root = NULL;
+	spt->page_cnt = 0;
+}
+
+/* Makes the current process share the frame of SRC, a resident
+ * anonymous page of the parent, copy-on-write: both are mapped
+ * read-only until one of them writes (see vm_handle_wp()).  The
+ * child's page is mapped read-only here; the parent's is left to
+ * supplemental_page_table_copy(), which write-protects a whole run
+ * of them at once. */
+static bool
+share_page (struct page *src) {
+	struct page *dst = malloc (sizeof *dst);
+	bool mapped;
+
+	if (dst == NULL)
+		return false;
+	*dst = *src;
+	dst->frame = NULL;
+	dst->owner = thread_current ();
+	dst->anon.slot = NO_SLOT;
+	dst->anon.zhandle = NO_ZHANDLE;
+	if (!spt_insert_page (&dst->owner->spt, dst)) {
+		free (dst);
+		return false;
+	}
+
+	while (!vm_pin_page (src))
+		if (!vm_do_claim_page (src))
+			return false;
+
+	lock_acquire (&frame_lock);
+	if ((src->frame->flags & FRAME_HUGE) && !split_huge (src->frame)) {
+		src->frame->pin_cnt--;
+		lock_release (&frame_lock);
+		return false;
+	}
+	frame_link (src->frame, dst);
+	mapped = map_page (dst);
+	if (!mapped)
+		frame_unlink (dst);
+	src->frame->pin_cnt--;
+	lock_release (&frame_lock);
+
+	if (mapped)
+		cow_share_cnt++;
+	return mapped;
 }
 
-/* Copy supplemental page table from src to dst */
+/* Run of the parent's pages that were shared with the child and
+ * are still writable in the parent's page table. */
+struct cow_run {
+	uint64_t *pml4;         /* The parent's page table. */
+	uint8_t *start;         /* First page of the run... */
+	uint8_t *end;           /* ...and the end of it. */
+};
+
+/* Write-protects the pages of RUN in the parent, with one walk of
+ * its page table and one batched TLB flush, and empties it. */
+static void
+cow_run_protect (struct cow_run *run) {
+	if (run->start == run->end)
+		return;
+	lock_acquire (&frame_lock);
+	pml4_protect_range (run->pml4, run->start, run->end, false);
+	lock_release (&frame_lock);
+	run->start = run->end = NULL;
+}
+
+/* Adds SRC, a page of the parent that was just shared, to RUN,
+ * protecting the run so far first unless SRC extends it. */
+static void
+cow_run_add (struct cow_run *run, struct page *src) {
+	if (src->va != run->end) {
+		cow_run_protect (run);
+		run->start = src->va;
+	}
+	run->pml4 = src->owner->pml4;
+	run->end = (uint8_t *) src->va + PGSIZE;
+}
+
+/* Duplicates SRC, a page of the parent, into the current
+ * process.  Pages never touched stay lazy, and resident anonymous
+ * ones are shared and added to the cow_run in AUX; the others are
+ * copied right away. */
+static bool
+copy_page (struct page *src, void *run) {
+	enum vm_type type = page_get_type (src);
+	struct page *dst;
+
+	if (VM_TYPE (src->operations->type) == VM_UNINIT) {
+		struct file_page *info = src->uninit.aux;
+
+		if (info != NULL) {
+			info = malloc (sizeof *info);
+			if (info == NULL)
+				return false;
+			*info = *(struct file_page *) src->uninit.aux;
+			info->file = file_reopen (info->file);
+			if (info->file == NULL) {
+				free (info);
+				return false;
+			}
+		}
+		if (!vm_alloc_page_with_initializer (src->uninit.type, src->va,
+					src->writable, src->uninit.init, info)) {
+			if (info != NULL) {
+				file_close (info->file);
+				free (info);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	if (type == VM_ANON) {
+		if (!share_page (src))
+			return false;
+		cow_run_add (run, src);
+		return true;
+	}
+	if (!vm_alloc_page (type, src->va, src->writable))
+		return false;
+	dst = spt_find_page (&thread_current ()->spt, src->va);
+
+	/* Claiming frames may evict either page, so bring both in and
+	 * hold them there for the copy. */
+	while (!vm_pin_page (src))
+		if (!vm_do_claim_page (src))
+			return false;
+	while (!vm_pin_page (dst))
+		if (!vm_do_claim_page (dst)) {
+			vm_unpin_page (src);
+			return false;
+		}
+	if (type == VM_FILE) {
+		dst->file = src->file;
+		dst->file.file = file_reopen (src->file.file);
+	}
+	memcpy (dst->frame->kva, src->frame->kva, PGSIZE);
+	vm_unpin_page (dst);
+	vm_unpin_page (src);
+	return type != VM_FILE || dst->file.file != NULL;
+}
+
+/* Copy supplemental page table from src to dst.
+ * The parent is blocked until this returns, so its shared pages
+ * only need to be write-protected by then; each run of them is
+ * done at once. */
 bool
 supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
-		struct supplemental_page_table *src UNUSED) {
+		struct supplemental_page_table *src) {
+	int64_t start = timer_ticks ();
+	struct cow_run run = { NULL, NULL, NULL };
+	bool success = spt_for_each (src, NULL, (void *) KERN_BASE, copy_page,
+			&run);
+
+	cow_run_protect (&run);
+	fork_ticks += timer_elapsed (start);
+	return success;
+}
+
+/* Removes PAGE from SPT, which is AUX. */
+static bool
+kill_page (struct page *page, void *spt) {
+	spt_remove_page (spt, page);
+	return true;
+}
+
+/* Removes every mapping of the current process in [START, END)
+ * from its page table in one pass, with one batched TLB flush,
+ * ahead of destroying the pages there.  Whatever the dirty bits
+ * said must have been acted on already. */
+void
+vm_clear_range (void *start, void *end) {
+	uint64_t *pml4 = thread_current ()->pml4;
+
+	if (pml4 == NULL)
+		return;
+	/* The daemons walk this page table under frame_lock, and the
+	 * page-table pages left empty are freed. */
+	lock_acquire (&frame_lock);
+	pml4_clear_range (pml4, start, end);
+	lock_release (&frame_lock);
 }
 
 /* Free the resource hold by the supplemental page table */
 void
-supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
-	/* TODO: Destroy all the supplemental_page_table hold by thread and
-	 * TODO: writeback all the modified contents to the storage. */
+supplemental_page_table_kill (struct supplemental_page_table *spt) {
+	vm_file_writeback (spt, NULL, (void *) KERN_BASE);
+	vm_clear_range (NULL, (void *) KERN_BASE);
+	spt_for_each (spt, NULL, (void *) KERN_BASE, kill_page, spt);
+	if (spt->root != NULL)
+		spt_free_node (spt->root, 0);
+	spt->root = NULL;
+	text_reap ();
 }
@@ -0,0 +1,311 @@
+/* zswap.c: Compressed pool of swapped-out anonymous pages.
+ *
+ * Writing a page to the IDE disk by PIO costs tens of thousands of
+ * cycles per sector, while compressing it costs a few per byte.  So
+ * an evicted anonymous page is first compressed into a pool of
+ * kernel pages set aside with -zs, and goes to the swap disk only
+ * if the pool is full or the page does not compress well.
+ *
+ * The pool is cut into chunks of ZCHUNK bytes, tracked in a bitmap.
+ * A compressed page takes a run of chunks inside one pool page,
+ * starting with a 2-byte length, and its handle is the index of the
+ * first chunk.
+ *
+ * The codec is a byte-oriented LZ77 in the style of LZ4.  The
+ * output is a sequence of
+ *
+ *    token, [literal length bytes], literals, offset, [match bytes]
+ *
+ * where the high nibble of the token is the number of literals and
+ * the low nibble the match length minus ZMIN_MATCH; a nibble of 15
+ * is continued by bytes that are added to it until one is not 255.
+ * The offset is 2 bytes, little endian.  The last sequence has
+ * literals only, and ends where the page does. */
+
+#include "vm/zswap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+size_t zswap_pool_pages;
+
+/* Pool chunk size, and chunks per pool page. */
+#define ZCHUNK 64
+#define ZCHUNKS_PER_PAGE (PGSIZE / ZCHUNK)
+
+/* A page that does not shrink below this many bytes, length
+ * included, is not worth its place in the pool. */
+#define ZMAX_STORED (PGSIZE * 3 / 4)
+
+/* Shortest match, and bits of the match finder's hash. */
+#define ZMIN_MATCH 4
+#define ZHASH_BITS 12
+
+static struct lock zswap_lock;      /* Protects everything below. */
+static uint8_t **pool;              /* The pool pages. */
+static struct bitmap *chunk_map;    /* Chunks in use. */
+static size_t cursor;               /* Pool page to try first. */
+
+/* Scratch space of the compressor. */
+static uint16_t hash_table[1 << ZHASH_BITS];
+static uint8_t scratch[ZMAX_STORED];
+
+/* Statistics. */
+static long long stored_cnt;        /* Pages put in the pool. */
+static long long loaded_cnt;        /* Pages read back from it. */
+static long long rejected_cnt;      /* Pages that did not compress. */
+static long long full_cnt;          /* Pages turned away, pool full. */
+static long long bytes_in;          /* Sum of stored page sizes... */
+static long long bytes_out;         /* ...and of their compressed size. */
+
+/* Sets up a pool of zswap_pool_pages pages, if any. */
+void
+zswap_init (void) {
+	lock_init (&zswap_lock);
+	if (zswap_pool_pages == 0)
+		return;
+
+	pool = calloc (zswap_pool_pages, sizeof *pool);
+	chunk_map = bitmap_create (zswap_pool_pages * ZCHUNKS_PER_PAGE);
+	if (pool == NULL || chunk_map == NULL)
+		PANIC ("zswap_init: cannot allocate a %zu-page pool", zswap_pool_pages);
+	for (size_t i = 0; i < zswap_pool_pages; i++) {
+		pool[i] = palloc_get_page (0);
+		if (pool[i] == NULL)
+			PANIC ("zswap_init: only %zu of %zu pool pages available",
+					i, zswap_pool_pages);
+	}
+}
+
+static uint32_t
+read32 (const uint8_t *p) {
+	uint32_t v;
+	memcpy (&v, p, sizeof v);
+	return v;
+}
+
+/* Appends length LEN, whose first 15 went in a token nibble, to
+ * OUT at *POS.  Returns false if that would pass CAP. */
+static bool
+put_length (uint8_t *out, size_t *pos, size_t cap, size_t len) {
+	if (len < 15)
+		return true;
+	for (len -= 15; ; len -= 255) {
+		if (*pos >= cap)
+			return false;
+		out[(*pos)++] = len < 255 ? len : 255;
+		if (len < 255)
+			return true;
+	}
+}
+
+/* Appends a sequence of the literals IN[ANCHOR, END) followed by a
+ * match of MATCH bytes at OFFSET, or no match if MATCH is 0. */
+static bool
+put_sequence (uint8_t *out, size_t *pos, size_t cap, const uint8_t *in,
+		size_t anchor, size_t end, size_t offset, size_t match) {
+	size_t lits = end - anchor;
+	size_t mlen = match != 0 ? match - ZMIN_MATCH : 0;
+
+	if (*pos >= cap)
+		return false;
+	out[(*pos)++] = (lits < 15 ? lits : 15) << 4 | (mlen < 15 ? mlen : 15);
+	if (!put_length (out, pos, cap, lits) || *pos + lits > cap)
+		return false;
+	memcpy (out + *pos, in + anchor, lits);
+	*pos += lits;
+	if (match == 0)
+		return true;
+
+	if (*pos + 2 > cap)
+		return false;
+	out[(*pos)++] = offset & 0xff;
+	out[(*pos)++] = offset >> 8;
+	return put_length (out, pos, cap, mlen);
+}
+
+/* Compresses the page at IN into OUT, which has room for CAP bytes.
+ * Returns the compressed size, or 0 if it would not fit. */
+static size_t
+compress (const uint8_t *in, uint8_t *out, size_t cap) {
+	size_t pos = 0, anchor = 0, i = 0;
+
+	memset (hash_table, 0, sizeof hash_table);
+	while (i + ZMIN_MATCH <= PGSIZE) {
+		uint32_t seq = read32 (in + i);
+		size_t h = (seq * 2654435761U) >> (32 - ZHASH_BITS);
+		size_t cand = hash_table[h];
+		size_t len;
+
+		hash_table[h] = i;
+		if (cand >= i || read32 (in + cand) != seq) {
+			i++;
+			continue;
+		}
+		for (len = ZMIN_MATCH; i + len < PGSIZE; len++)
+			if (in[cand + len] != in[i + len])
+				break;
+		if (!put_sequence (out, &pos, cap, in, anchor, i, i - cand, len))
+			return 0;
+		i += len;
+		anchor = i;
+	}
+	if (!put_sequence (out, &pos, cap, in, anchor, PGSIZE, 0, 0))
+		return 0;
+	return pos;
+}
+
+/* Reads a length whose first part is NIBBLE from IN at *POS. */
+static size_t
+get_length (const uint8_t *in, size_t *pos, size_t nibble) {
+	size_t len = nibble;
+
+	if (nibble == 15) {
+		uint8_t b;
+		do {
+			b = in[(*pos)++];
+			len += b;
+		} while (b == 255);
+	}
+	return len;
+}
+
+/* Expands the output of compress() at IN into the page at OUT. */
+static void
+decompress (const uint8_t *in, uint8_t *out) {
+	size_t pos = 0, o = 0;
+
+	for (;;) {
+		uint8_t token = in[pos++];
+		size_t lits = get_length (in, &pos, token >> 4);
+		size_t offset, match;
+
+		ASSERT (o + lits <= PGSIZE);
+		memcpy (out + o, in + pos, lits);
+		pos += lits;
+		o += lits;
+		if (o == PGSIZE)
+			break;
+
+		offset = in[pos] | in[pos + 1] << 8;
+		pos += 2;
+		match = get_length (in, &pos, token & 15) + ZMIN_MATCH;
+		ASSERT (offset != 0 && offset <= o && o + match <= PGSIZE);
+
+		/* The match may overlap what it produces, as in a run. */
+		for (; match > 0; match--, o++)
+			out[o] = out[o - offset];
+	}
+}
+
+/* Returns the address of chunk CHUNK. */
+static uint8_t *
+chunk_addr (size_t chunk) {
+	return pool[chunk / ZCHUNKS_PER_PAGE] + chunk % ZCHUNKS_PER_PAGE * ZCHUNK;
+}
+
+/* Reserves CNT chunks within one pool page, trying from the cursor
+ * on.  Returns the first, or BITMAP_ERROR if the pool is full. */
+static size_t
+chunk_alloc (size_t cnt) {
+	for (size_t n = 0; n < zswap_pool_pages; n++) {
+		size_t page = (cursor + n) % zswap_pool_pages;
+		size_t first = page * ZCHUNKS_PER_PAGE;
+
+		for (size_t c = first; c + cnt <= first + ZCHUNKS_PER_PAGE; c++)
+			if (!bitmap_contains (chunk_map, c, cnt, true)) {
+				bitmap_set_multiple (chunk_map, c, cnt, true);
+				cursor = page;
+				return c;
+			}
+	}
+	return BITMAP_ERROR;
+}
+
+/* Compresses the page at KVA into the pool.  Returns its handle,
+ * or NO_ZHANDLE if the pool is full or the page did not compress
+ * well enough to be kept there. */
+size_t
+zswap_store (const void *kva) {
+	size_t len, chunk = NO_ZHANDLE;
+	uint16_t stored_len;
+
+	if (pool == NULL)
+		return NO_ZHANDLE;
+
+	lock_acquire (&zswap_lock);
+	len = compress (kva, scratch, sizeof scratch - sizeof stored_len);
+	if (len == 0)
+		rejected_cnt++;
+	else {
+		size_t cnt = DIV_ROUND_UP (sizeof stored_len + len, ZCHUNK);
+
+		chunk = chunk_alloc (cnt);
+		if (chunk == BITMAP_ERROR) {
+			chunk = NO_ZHANDLE;
+			full_cnt++;
+		} else {
+			stored_len = len;
+			memcpy (chunk_addr (chunk), &stored_len, sizeof stored_len);
+			memcpy (chunk_addr (chunk) + sizeof stored_len, scratch, len);
+			stored_cnt++;
+			bytes_in += PGSIZE;
+			bytes_out += len;
+		}
+	}
+	lock_release (&zswap_lock);
+	return chunk;
+}
+
+/* Gives back the chunks of HANDLE.  zswap_lock must be held. */
+static void
+chunk_free (size_t handle) {
+	uint16_t len;
+
+	memcpy (&len, chunk_addr (handle), sizeof len);
+	bitmap_set_multiple (chunk_map, handle,
+			DIV_ROUND_UP (sizeof len + len, ZCHUNK), false);
+}
+
+/* Decompresses the page with HANDLE into KVA, and drops it from the
+ * pool. */
+void
+zswap_load (size_t handle, void *kva) {
+	lock_acquire (&zswap_lock);
+	decompress (chunk_addr (handle) + sizeof (uint16_t), kva);
+	chunk_free (handle);
+	loaded_cnt++;
+	lock_release (&zswap_lock);
+}
+
+/* Drops the page with HANDLE from the pool without reading it. */
+void
+zswap_free (size_t handle) {
+	lock_acquire (&zswap_lock);
+	chunk_free (handle);
+	lock_release (&zswap_lock);
+}
+
+/* Prints pool statistics.  DISK_LOADS is the number of swap-ins
+ * that had to go to the disk instead. */
+void
+zswap_print_stats (long long disk_loads) {
+	if (pool == NULL)
+		return;
+	printf ("Zswap: %zu-page pool: %lld pages stored at %lld%% of their size, "
+			"%lld incompressible, %lld turned away full\n",
+			zswap_pool_pages, stored_cnt,
+			bytes_in > 0 ? bytes_out * 100 / bytes_in : 0,
+			rejected_cnt, full_cnt);
+	printf ("Zswap: %lld of %lld swap-ins served from memory (%lld%%)\n",
+			loaded_cnt, loaded_cnt + disk_loads,
+			loaded_cnt + disk_loads > 0
+			? loaded_cnt * 100 / (loaded_cnt + disk_loads) : 0);
+}